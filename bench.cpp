@@ -0,0 +1,336 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+
+#include <sys/resource.h>
+
+#include "file_storage.h"
+
+using namespace std;
+using namespace filestorage;
+
+// Workload generator and timer for the storage engines. Runs a random mix
+// of insert/delete/find over a fixed key pool, optionally split over
+// several process-like runs that close and reopen the store, and reports
+// throughput, per-op latency percentiles, peak RSS and on-disk size.
+
+struct BenchOptions {
+    uint64_t ops = 100000;
+    uint64_t keys = 10000;
+    // Operation mix in percent; whatever is left over is find
+    unsigned insertPercent = 50;
+    unsigned deletePercent = 10;
+    size_t minKeyLength = 8;
+    size_t maxKeyLength = 24;
+    // Each key draws its values from [0, n), n between 1 and maxValues
+    unsigned maxValues = 64;
+    bool zipfValues = false;   // Skew n towards 1 instead of uniform
+    double zipfTheta = 0;      // Key popularity skew, 0 = uniform
+    unsigned runs = 1;         // The store is reopened before each run
+    uint64_t seed = 1;
+    string dir = "bench-data";
+    bool keep = false;         // Keep the files of an earlier benchmark
+    string emit;               // Write the ops as command input instead
+};
+
+// Zipfian ranks in [0, n) after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as used by YCSB. Rank 0 is the most
+// popular; theta = 0 degenerates to uniform.
+class ZipfGenerator {
+private:
+    uint64_t n;
+    double theta;
+    double alpha = 0;
+    double zetan = 0;
+    double eta = 0;
+    uniform_real_distribution<double> unit{0.0, 1.0};
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) sum += 1.0 / pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+public:
+    ZipfGenerator(uint64_t count, double skew) : n(max<uint64_t>(count, 1)), theta(skew) {
+        if (theta <= 0) return;
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zetan);
+    }
+
+    uint64_t next(mt19937_64& rng) {
+        if (theta <= 0) return rng() % n;
+        double u = unit(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta)) return 1;
+        return min<uint64_t>(n - 1, static_cast<uint64_t>(n * pow(eta * u - eta + 1.0, alpha)));
+    }
+};
+
+struct Operation {
+    char type;
+    uint32_t key;
+    int value;
+};
+
+// The key pool and the operation stream, both fixed by the seed
+class Workload {
+private:
+    const BenchOptions& options;
+    mt19937_64 rng;
+    ZipfGenerator keyRanks;
+    vector<string> indexes;
+    vector<uint32_t> valueRange;   // Per key
+
+public:
+    explicit Workload(const BenchOptions& benchOptions)
+        : options(benchOptions), rng(benchOptions.seed), keyRanks(benchOptions.keys, benchOptions.zipfTheta) {
+        ZipfGenerator valueCounts(options.maxValues, options.zipfValues ? 0.99 : 0);
+        uniform_int_distribution<size_t> length(options.minKeyLength, max(options.minKeyLength, options.maxKeyLength));
+        for (uint64_t i = 0; i < options.keys; i++) {
+            // The key number keeps indexes unique; random letters pad it
+            string index = to_string(i);
+            size_t target = length(rng);
+            while (index.size() < target) index.push_back('a' + rng() % 26);
+            indexes.push_back(index);
+            valueRange.push_back(options.zipfValues ? valueCounts.next(rng) + 1 : rng() % options.maxValues + 1);
+        }
+        // Hot keys should not all sort next to each other
+        shuffle(indexes.begin(), indexes.end(), rng);
+    }
+
+    string_view index(uint32_t key) const {
+        return indexes[key];
+    }
+
+    Operation next() {
+        Operation op;
+        op.key = keyRanks.next(rng);
+        op.value = rng() % valueRange[op.key];
+        unsigned roll = rng() % 100;
+        op.type = roll < options.insertPercent ? 'i'
+                : roll < options.insertPercent + options.deletePercent ? 'd'
+                : 'f';
+        return op;
+    }
+};
+
+struct RunStats {
+    double openSeconds = 0;
+    double runSeconds = 0;
+    double closeSeconds = 0;
+    vector<uint32_t> latencies[3];   // Nanoseconds, per insert/delete/find
+};
+
+inline size_t typeSlot(char type) {
+    return type == 'i' ? 0 : type == 'd' ? 1 : 2;
+}
+
+double seconds(chrono::steady_clock::duration elapsed) {
+    return chrono::duration<double>(elapsed).count();
+}
+
+// Sorts latencies and returns the q quantile, in microseconds
+double quantile(vector<uint32_t>& latencies, double q) {
+    if (latencies.empty()) return 0;
+    size_t pos = min(latencies.size() - 1, static_cast<size_t>(q * latencies.size()));
+    nth_element(latencies.begin(), latencies.begin() + pos, latencies.end());
+    return latencies[pos] / 1000.0;
+}
+
+uint64_t storeBytes() {
+    uint64_t bytes = 0;
+    for (const auto& entry : filesystem::directory_iterator(".")) {
+        if (entry.is_regular_file() && entry.path().filename().string().rfind(DEFAULT_STORE, 0) == 0) {
+            bytes += entry.file_size();
+        }
+    }
+    return bytes;
+}
+
+long peakRssKilobytes() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void printLatencies(const char* name, vector<uint32_t>& latencies) {
+    if (latencies.empty()) return;
+    printf("  %-6s %9zu ops  p50 %8.2f us  p99 %8.2f us  p999 %8.2f us\n", name, latencies.size(),
+           quantile(latencies, 0.50), quantile(latencies, 0.99), quantile(latencies, 0.999));
+}
+
+template <typename Engine>
+int runBench(const BenchOptions& options, const StorageOptions& storageOptions) {
+    Workload workload(options);
+    RunStats total;
+    uint64_t found = 0;   // Keeps find from being optimized away
+
+    for (unsigned run = 0; run < options.runs; run++) {
+        RunStats stats;
+        uint64_t runOps = options.ops * (run + 1) / options.runs - options.ops * run / options.runs;
+
+        auto start = chrono::steady_clock::now();
+        auto storage = make_unique<ShardedStorage<Engine>>(storageOptions);
+        auto opened = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < runOps; i++) {
+            Operation op = workload.next();
+            string_view index = workload.index(op.key);
+            auto before = chrono::steady_clock::now();
+            if (op.type == 'i') {
+                storage->insert(index, op.value);
+            } else if (op.type == 'd') {
+                storage->remove(index, op.value);
+            } else {
+                storage->forEachValue(index, [&](int value) {
+                    found += value;
+                });
+            }
+            auto elapsed = chrono::steady_clock::now() - before;
+            stats.latencies[typeSlot(op.type)].push_back(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+        }
+        auto ran = chrono::steady_clock::now();
+        storage.reset();
+        auto closed = chrono::steady_clock::now();
+
+        stats.openSeconds = seconds(opened - start);
+        stats.runSeconds = seconds(ran - opened);
+        stats.closeSeconds = seconds(closed - ran);
+        printf("run %u: %" PRIu64 " ops  open %.3f s  run %.3f s  close %.3f s  %.0f ops/s  store %" PRIu64 " bytes\n",
+               run + 1, runOps, stats.openSeconds, stats.runSeconds, stats.closeSeconds,
+               runOps / max(stats.runSeconds, 1e-9), storeBytes());
+
+        total.openSeconds += stats.openSeconds;
+        total.runSeconds += stats.runSeconds;
+        total.closeSeconds += stats.closeSeconds;
+        for (size_t slot = 0; slot < 3; slot++) {
+            total.latencies[slot].insert(total.latencies[slot].end(), stats.latencies[slot].begin(),
+                                         stats.latencies[slot].end());
+        }
+    }
+
+    printf("total: %" PRIu64 " ops in %.3f s  %.0f ops/s  open %.3f s  close %.3f s\n", options.ops,
+           total.runSeconds, options.ops / max(total.runSeconds, 1e-9), total.openSeconds, total.closeSeconds);
+    vector<uint32_t> all;
+    for (auto& latencies : total.latencies) all.insert(all.end(), latencies.begin(), latencies.end());
+    printLatencies("all", all);
+    printLatencies("insert", total.latencies[0]);
+    printLatencies("delete", total.latencies[1]);
+    printLatencies("find", total.latencies[2]);
+    printf("peak rss %ld KiB  store %" PRIu64 " bytes  (checksum %" PRIu64 ")\n", peakRssKilobytes(), storeBytes(), found);
+#ifdef FILESTORAGE_STATS
+    printf("%s", statsReport().c_str());
+#endif
+    return 0;
+}
+
+// Writes the operation stream as input for the main program, so that the
+// same workload can be fed through its command parser
+int emitCommands(const BenchOptions& options) {
+    FILE* out = fopen(options.emit.c_str(), "w");
+    if (out == nullptr) {
+        cerr << options.emit << ": cannot open for writing" << endl;
+        return 1;
+    }
+
+    Workload workload(options);
+    fprintf(out, "%" PRIu64 "\n", options.ops);
+    for (uint64_t i = 0; i < options.ops; i++) {
+        Operation op = workload.next();
+        string_view index = workload.index(op.key);
+        if (op.type == 'f') {
+            fprintf(out, "find %.*s\n", static_cast<int>(index.size()), index.data());
+        } else {
+            fprintf(out, "%s %.*s %d\n", op.type == 'i' ? "insert" : "delete", static_cast<int>(index.size()),
+                    index.data(), op.value);
+        }
+    }
+    return fclose(out) == 0 ? 0 : 1;
+}
+
+// Parses --name=value flags; storage flags are the same as for the main
+// program. Returns false on an unknown flag or a bad value.
+bool parseBenchOptions(int argc, char* argv[], BenchOptions& options, StorageOptions& storageOptions) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "--ops") {
+            options.ops = stoull(value);
+        } else if (name == "--keys") {
+            options.keys = max(1ull, stoull(value));
+        } else if (name == "--insert") {
+            options.insertPercent = stoul(value);
+        } else if (name == "--delete") {
+            options.deletePercent = stoul(value);
+        } else if (name == "--key-length") {
+            // min[-max]
+            size_t dash = value.find('-');
+            options.minKeyLength = stoul(value.substr(0, dash));
+            options.maxKeyLength = dash == string::npos ? options.minKeyLength : stoul(value.substr(dash + 1));
+        } else if (name == "--values") {
+            options.maxValues = max(1ul, stoul(value));
+        } else if (name == "--value-dist" && (value == "uniform" || value == "zipf")) {
+            options.zipfValues = value == "zipf";
+        } else if (name == "--zipf") {
+            options.zipfTheta = stod(value);
+        } else if (name == "--runs") {
+            options.runs = max(1ul, stoul(value));
+        } else if (name == "--seed") {
+            options.seed = stoull(value);
+        } else if (name == "--dir") {
+            options.dir = value;
+        } else if (name == "--keep") {
+            options.keep = true;
+        } else if (name == "--emit") {
+            options.emit = value;
+        } else if (!parseStorageOption(name, value, storageOptions)) {
+            cerr << "unknown option or bad value: " << arg << endl;
+            return false;
+        }
+    }
+    if (options.insertPercent + options.deletePercent > 100 || options.zipfTheta >= 1) {
+        cerr << "insert + delete must be at most 100 and --zipf below 1" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    StorageOptions storageOptions;
+    if (!parseBenchOptions(argc, argv, options, storageOptions)) {
+        return 1;
+    }
+    if (!options.emit.empty()) {
+        return emitCommands(options);
+    }
+
+    // The store always uses the default file names, so it gets a directory
+    // of its own
+    filesystem::create_directories(options.dir);
+    filesystem::current_path(options.dir);
+    if (!options.keep) {
+        for (const auto& entry : filesystem::directory_iterator(".")) {
+            if (entry.path().filename().string().rfind(DEFAULT_STORE, 0) == 0) filesystem::remove(entry.path());
+        }
+    }
+
+    if (storageOptions.engine == StorageEngine::Lsm) {
+        return runBench<LsmStorage>(options, storageOptions);
+    }
+    return runBench<FileStorage>(options, storageOptions);
+}
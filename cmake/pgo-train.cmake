@@ -0,0 +1,43 @@
+# Training run for profile-guided builds, run by the pgo-train target with
+# BENCH, CODE, WORK_DIR, PROFILE_DIR, COMPILER_ID and LLVM_PROFDATA set.
+# bench drives both engines through their insert, delete and find paths;
+# code replays a generated command stream, so the parser and the batch
+# executor are profiled as well.
+
+# Profiles from an earlier training run would add to this one's counts
+file(REMOVE_RECURSE ${WORK_DIR} ${PROFILE_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+function(train)
+    execute_process(COMMAND ${ARGN} WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "training step failed (${result}): ${ARGN}")
+    endif()
+endfunction()
+
+# Skewed and uniform mixes over several reopens, so recovery is covered too
+train(${BENCH} --dir=btree-zipf --ops=300000 --keys=20000 --zipf=0.99 --runs=3)
+train(${BENCH} --dir=btree-reads --ops=300000 --keys=5000 --insert=20 --delete=5 --value-dist=zipf)
+train(${BENCH} --dir=btree-shards --ops=200000 --shards=4 --snapshot-slots=1024 --runs=2)
+train(${BENCH} --dir=lsm --engine=lsm --ops=100000 --keys=20000 --zipf=0.9 --runs=2)
+
+# The command stream is replayed twice, the second time on top of the files
+# the first one left, plain and in batch mode
+train(${BENCH} --emit=${WORK_DIR}/commands.txt --ops=100000 --keys=10000 --zipf=0.9)
+file(MAKE_DIRECTORY ${WORK_DIR}/code)
+foreach(flags "" "--batch=1024")
+    execute_process(COMMAND ${CODE} ${flags} INPUT_FILE ${WORK_DIR}/commands.txt OUTPUT_QUIET
+                    WORKING_DIRECTORY ${WORK_DIR}/code RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "training step failed (${result}): ${CODE} ${flags}")
+    endif()
+endforeach()
+
+# Clang leaves raw profiles that have to be merged before use
+if(COMPILER_ID MATCHES "Clang")
+    if(NOT LLVM_PROFDATA)
+        message(FATAL_ERROR "llvm-profdata is needed to merge Clang profiles")
+    endif()
+    file(GLOB rawProfiles ${PROFILE_DIR}/*.profraw)
+    train(${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/default.profdata ${rawProfiles})
+endif()
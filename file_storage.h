@@ -0,0 +1,4940 @@
+// Storage engine: an append-only data file of fixed-width records, indexed
+// by a disk-resident B+ tree, plus ShardedStorage, which spreads indexes over
+// several such stores for concurrent callers.
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <thread>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <type_traits>
+#include <limits>
+#include <cerrno>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+// Functions may be compiled for newer instruction sets and picked at run time
+#define FILESTORAGE_HAVE_CPU_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FILESTORAGE_HAVE_MMAP 1
+#define FILESTORAGE_HAVE_POSIX_IO 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+// Batched I/O may go through an io_uring, driven without liburing
+#define FILESTORAGE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+namespace filestorage {
+
+// Base name of the files of an unsharded store
+const std::string DEFAULT_STORE = "storage";
+
+const uint32_t PAGE_SIZE = 4096;
+const uint32_t INDEX_MAGIC = 0x58444946;  // "FIDX"
+const uint32_t INDEX_VERSION = 3;
+const size_t KEY_BYTES = 64;
+
+// (index, value) pair as stored in index pages. The index is zero padded to
+// KEY_BYTES, so comparing the raw bytes gives the same order as comparing
+// the strings.
+struct Key {
+    char index[KEY_BYTES];
+    int32_t value;
+};
+
+inline Key makeKey(const char* index, size_t indexLen, int value) {
+    Key key;
+    memset(key.index, 0, KEY_BYTES);
+    memcpy(key.index, index, std::min(indexLen, KEY_BYTES));
+    key.value = value;
+    return key;
+}
+
+inline Key makeKey(std::string_view index, int value) {
+    return makeKey(index.data(), index.length(), value);
+}
+
+// 64-bit FNV-1a, the one string hash of the engine. Its users finalize it
+// as their bit selection needs.
+inline uint64_t fnv1a(std::string_view bytes) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : bytes) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+#define FILESTORAGE_TARGET_AVX2 __attribute__((target("avx2")))
+
+inline bool cpuHasAvx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+// Bit i is set where byte i of two KEY_BYTES indexes differs. SSE2 is part
+// of x86-64, so this needs no dispatch.
+inline uint64_t indexDifferences(const char* a, const char* b) {
+    uint64_t equal = 0;
+    for (size_t i = 0; i < KEY_BYTES / 16; i++) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a) + i);
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b) + i);
+        equal |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)))) << (16 * i);
+    }
+    return ~equal;
+}
+
+FILESTORAGE_TARGET_AVX2 inline uint64_t indexDifferencesAvx2(const char* a, const char* b) {
+    uint64_t equal = 0;
+    for (size_t i = 0; i < KEY_BYTES / 32; i++) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a) + i);
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b) + i);
+        equal |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)))) << (32 * i);
+    }
+    return ~equal;
+}
+#endif
+
+// Sign of memcmp over two KEY_BYTES indexes
+inline int compareIndexes(const char* a, const char* b) {
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    uint64_t differences = indexDifferences(a, b);
+    if (differences == 0) return 0;
+    int first = __builtin_ctzll(differences);
+    return static_cast<unsigned char>(a[first]) - static_cast<unsigned char>(b[first]);
+#else
+    return memcmp(a, b, KEY_BYTES);
+#endif
+}
+
+inline int compareKeys(const Key& a, const Key& b) {
+    int cmp = compareIndexes(a.index, b.index);
+    if (cmp != 0) return cmp;
+    if (a.value != b.value) return a.value < b.value ? -1 : 1;
+    return 0;
+}
+
+inline bool sameIndex(const Key& a, const Key& b) {
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    return indexDifferences(a.index, b.index) == 0;
+#else
+    return memcmp(a.index, b.index, KEY_BYTES) == 0;
+#endif
+}
+
+// Branchless binary search over count sorted keys laid out stride bytes
+// apart: returns the number of keys < key, or <= key with orEqual. The
+// halving step compiles to a conditional move, so the only unpredictable
+// branches left are inside the key comparison.
+inline uint32_t searchKeysPortable(const Key* first, size_t stride, uint32_t count, const Key& key, bool orEqual) {
+    if (count == 0) return 0;
+    const char* base = reinterpret_cast<const char*>(first);
+    int limit = orEqual ? 1 : 0;
+    uint32_t lo = 0;
+    while (count > 1) {
+        uint32_t half = count / 2;
+        lo += compareKeys(*reinterpret_cast<const Key*>(base + (lo + half) * stride), key) < limit ? half : 0;
+        count -= half;
+    }
+    return lo + (compareKeys(*reinterpret_cast<const Key*>(base + lo * stride), key) < limit);
+}
+
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+FILESTORAGE_TARGET_AVX2 inline int compareKeysAvx2(const Key& a, const Key& b) {
+    uint64_t differences = indexDifferencesAvx2(a.index, b.index);
+    if (differences != 0) {
+        int first = __builtin_ctzll(differences);
+        return static_cast<unsigned char>(a.index[first]) - static_cast<unsigned char>(b.index[first]);
+    }
+    if (a.value != b.value) return a.value < b.value ? -1 : 1;
+    return 0;
+}
+
+FILESTORAGE_TARGET_AVX2 inline uint32_t searchKeysAvx2(const Key* first, size_t stride, uint32_t count,
+                                                        const Key& key, bool orEqual) {
+    if (count == 0) return 0;
+    const char* base = reinterpret_cast<const char*>(first);
+    int limit = orEqual ? 1 : 0;
+    uint32_t lo = 0;
+    while (count > 1) {
+        uint32_t half = count / 2;
+        lo += compareKeysAvx2(*reinterpret_cast<const Key*>(base + (lo + half) * stride), key) < limit ? half : 0;
+        count -= half;
+    }
+    return lo + (compareKeysAvx2(*reinterpret_cast<const Key*>(base + lo * stride), key) < limit);
+}
+#endif
+
+// searchKeysPortable, using AVX2 comparisons when the CPU has them
+inline uint32_t searchKeys(const Key* first, size_t stride, uint32_t count, const Key& key, bool orEqual) {
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    if (cpuHasAvx2()) return searchKeysAvx2(first, stride, count, key, orEqual);
+#endif
+    return searchKeysPortable(first, stride, count, key, orEqual);
+}
+
+// lowerBoundValue halves the range without branches down to this many
+// values, then counts the ones below the target with vector compares
+const size_t VALUE_SCAN = 32;
+
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+FILESTORAGE_TARGET_AVX2 inline size_t lowerBoundValueAvx2(const int* values, size_t count, int value) {
+    size_t lo = 0;
+    while (count > VALUE_SCAN) {
+        size_t half = count / 2;
+        lo += values[lo + half] < value ? half : 0;
+        count -= half;
+    }
+
+    const int* window = values + lo;
+    __m256i target = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(window + i));
+        lo += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, block))));
+    }
+    for (; i < count; i++) lo += window[i] < value;
+    return lo;
+}
+#endif
+
+// Position of the first value >= value in count ascending ints, as
+// lower_bound would return it
+inline size_t lowerBoundValue(const int* values, size_t count, int value) {
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    if (cpuHasAvx2()) return lowerBoundValueAvx2(values, count, value);
+#endif
+    size_t lo = 0;
+    while (count > VALUE_SCAN) {
+        size_t half = count / 2;
+        lo += values[lo + half] < value ? half : 0;
+        count -= half;
+    }
+
+    // Everything before the window is below value and nothing after it is
+    const int* window = values + lo;
+    size_t i = 0;
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    __m128i target = _mm_set1_epi32(value);
+    for (; i + 4 <= count; i += 4) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window + i));
+        lo += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, block))));
+    }
+#endif
+    for (; i < count; i++) lo += window[i] < value;
+    return lo;
+}
+
+// Leaf slot: a key plus the data file offset of its live record
+struct Entry {
+    Key key;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+const uint32_t PAGE_FREE = 0;
+const uint32_t PAGE_LEAF = 1;
+const uint32_t PAGE_INNER = 2;
+
+const uint32_t LEAF_CAPACITY = (PAGE_SIZE - 16) / sizeof(Entry);
+const uint32_t INNER_CAPACITY = (PAGE_SIZE - 16 - 2 * sizeof(uint32_t)) / (sizeof(Key) + 2 * sizeof(uint32_t));
+const uint32_t LEAF_MIN = LEAF_CAPACITY / 2;
+const uint32_t INNER_MIN = INNER_CAPACITY / 2;
+// Bulk-loaded nodes are left a quarter empty so that the first inserts
+// after a load do not split every page they touch
+const uint32_t BULK_LEAF_FILL = LEAF_CAPACITY * 3 / 4;
+const uint32_t BULK_INNER_FILL = INNER_CAPACITY * 3 / 4;
+
+// Page 0 of the index file
+struct MetaPage {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t root;
+    uint32_t pageCount;
+    uint32_t freeList;    // Head of the free page chain, 0 = none
+    uint32_t dirty;       // Set while a process has the index open
+    uint64_t logBytes;    // Size of the data file the index matches
+    uint64_t entryCount;
+    uint64_t deadBytes;   // Bytes of deleted records in the data file
+};
+
+struct LeafPage {
+    uint32_t type;
+    uint32_t count;
+    uint32_t next;        // Right sibling (or next free page), 0 = none
+    uint32_t reserved;
+    Entry entries[LEAF_CAPACITY];
+};
+
+// children[i] holds keys in [keys[i - 1], keys[i]), counts[i] of them
+struct InnerPage {
+    uint32_t type;
+    uint32_t count;       // Number of keys, there are count + 1 children
+    uint32_t reserved[2];
+    Key keys[INNER_CAPACITY];
+    uint32_t children[INNER_CAPACITY + 1];
+    uint32_t counts[INNER_CAPACITY + 1];   // Entries in each child's subtree
+};
+
+union Page {
+    char raw[PAGE_SIZE];
+    MetaPage meta;
+    LeafPage leaf;
+    InnerPage inner;
+};
+
+static_assert(sizeof(Page) == PAGE_SIZE, "index pages must be exactly PAGE_SIZE bytes");
+
+// A page buffer that O_DIRECT transfers can use
+struct alignas(PAGE_SIZE) AlignedPage {
+    Page page;
+};
+
+// Hot-path counters and latency histograms, compiled in with
+// FILESTORAGE_STATS. Without it FILESTORAGE_COUNT and FILESTORAGE_TIME
+// expand to nothing and statsReport() says so.
+enum class Stat {
+    BytesRead,
+    BytesWritten,
+    PageHits,         // Index page reads served by the buffer pool
+    PageMisses,       // Index page reads that went to the file
+    PageWritebacks,   // Dirty pages written on eviction or flush
+    BlockReads,       // Sorted run blocks read by the LSM engine
+    RecordsScanned,   // Entries visited by lookups and scans
+    SnapshotHits,     // Lookups served from the snapshot cache
+    LogFlushes,
+    COUNT
+};
+
+enum class Timer {
+    Insert,
+    Delete,
+    Find,
+    Count,
+    Exists,
+    Scan,
+    Load,
+    Parse,        // One input token
+    FileRead,
+    FileWrite,
+    IoBatch,      // One IoScheduler::run
+    LogFlush,
+    COUNT
+};
+
+#ifdef FILESTORAGE_STATS
+class StorageStats {
+private:
+    // Bucket b holds latencies in [2^b, 2^(b+1)) ns
+    static constexpr size_t BUCKETS = 40;
+    // Timers up to here are operations, reported with pages touched per call
+    static constexpr size_t OPERATION_TIMERS = static_cast<size_t>(Timer::Load) + 1;
+
+    struct Histogram {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> nanos{0};
+        std::atomic<uint64_t> pages{0};
+        std::atomic<uint64_t> buckets[BUCKETS] = {};
+    };
+
+    std::atomic<uint64_t> counters[static_cast<size_t>(Stat::COUNT)] = {};
+    Histogram timers[static_cast<size_t>(Timer::COUNT)];
+
+    static const char* statName(size_t stat) {
+        static const char* const names[] = {"bytes read", "bytes written", "page hits", "page misses",
+                                            "page writebacks", "block reads", "records scanned",
+                                            "snapshot hits", "log flushes"};
+        return names[stat];
+    }
+
+    static const char* timerName(size_t timer) {
+        static const char* const names[] = {"insert", "delete", "find", "count", "exists", "scan", "load", "parse",
+                                            "file read", "file write", "io batch", "log flush"};
+        return names[timer];
+    }
+
+    // Upper bound of the bucket holding the q quantile, in microseconds
+    static double quantile(const Histogram& histogram, uint64_t calls, double q) {
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            seen += histogram.buckets[b].load(std::memory_order_relaxed);
+            if (seen > q * calls) return static_cast<double>(uint64_t(1) << (b + 1)) / 1000;
+        }
+        return static_cast<double>(uint64_t(1) << BUCKETS) / 1000;
+    }
+
+public:
+    // Times one call into a histogram, including the pages it touched
+    class Scope {
+    private:
+        Histogram& histogram;
+        uint64_t pagesBefore;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    public:
+        explicit Scope(Timer timer)
+            : histogram(instance().timers[static_cast<size_t>(timer)]), pagesBefore(instance().pagesTouched()) {}
+
+        ~Scope() {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            size_t bucket = nanos == 0 ? 0 : std::min<size_t>(BUCKETS - 1, 63 - __builtin_clzll(nanos));
+            histogram.calls.fetch_add(1, std::memory_order_relaxed);
+            histogram.nanos.fetch_add(nanos, std::memory_order_relaxed);
+            histogram.pages.fetch_add(instance().pagesTouched() - pagesBefore, std::memory_order_relaxed);
+            histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    static StorageStats& instance() {
+        static StorageStats stats;
+        return stats;
+    }
+
+    void add(Stat stat, uint64_t amount) {
+        counters[static_cast<size_t>(stat)].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t get(Stat stat) const {
+        return counters[static_cast<size_t>(stat)].load(std::memory_order_relaxed);
+    }
+
+    uint64_t pagesTouched() const {
+        return get(Stat::PageHits) + get(Stat::PageMisses) + get(Stat::BlockReads);
+    }
+
+    std::string report() const {
+        std::string out;
+        char line[160];
+        for (size_t stat = 0; stat < static_cast<size_t>(Stat::COUNT); stat++) {
+            snprintf(line, sizeof(line), "%-16s %llu\n", statName(stat),
+                     static_cast<unsigned long long>(counters[stat].load(std::memory_order_relaxed)));
+            out += line;
+        }
+        uint64_t lookups = get(Stat::PageHits) + get(Stat::PageMisses);
+        snprintf(line, sizeof(line), "%-16s %.4f\n", "page hit ratio",
+                 lookups == 0 ? 0.0 : static_cast<double>(get(Stat::PageHits)) / lookups);
+        out += line;
+
+        for (size_t timer = 0; timer < static_cast<size_t>(Timer::COUNT); timer++) {
+            const Histogram& histogram = timers[timer];
+            uint64_t calls = histogram.calls.load(std::memory_order_relaxed);
+            if (calls == 0) continue;
+            int length = snprintf(line, sizeof(line),
+                                  "%-16s calls %llu  mean %.2f us  p50 %.2f us  p99 %.2f us  p999 %.2f us",
+                                  timerName(timer), static_cast<unsigned long long>(calls),
+                                  histogram.nanos.load(std::memory_order_relaxed) / 1000.0 / calls,
+                                  quantile(histogram, calls, 0.50), quantile(histogram, calls, 0.99),
+                                  quantile(histogram, calls, 0.999));
+            if (timer < OPERATION_TIMERS) {
+                snprintf(line + length, sizeof(line) - length, "  pages %.2f",
+                         static_cast<double>(histogram.pages.load(std::memory_order_relaxed)) / calls);
+            }
+            out += line;
+            out += '\n';
+        }
+        return out;
+    }
+};
+
+#define FILESTORAGE_STATS_CONCAT2(a, b) a##b
+#define FILESTORAGE_STATS_CONCAT(a, b) FILESTORAGE_STATS_CONCAT2(a, b)
+#define FILESTORAGE_COUNT(stat, amount) ::filestorage::StorageStats::instance().add(stat, amount)
+#define FILESTORAGE_TIME(timer) ::filestorage::StorageStats::Scope FILESTORAGE_STATS_CONCAT(statsScope, __LINE__)(timer)
+
+inline std::string statsReport() {
+    return StorageStats::instance().report();
+}
+#else
+#define FILESTORAGE_COUNT(stat, amount) ((void)0)
+#define FILESTORAGE_TIME(timer) ((void)0)
+
+inline std::string statsReport() {
+    return "stats not compiled in; build with FILESTORAGE_STATS\n";
+}
+#endif
+
+enum class FileMode {
+    ReadOnly,
+    ReadWrite,   // Created if missing
+    Truncate,    // Created or emptied
+};
+
+// Positional file I/O. On POSIX systems this is a bare descriptor driven by
+// pread/pwrite, so every call carries its own offset, no user-space buffer
+// sits in front of the kernel and concurrent readers can share one handle.
+// Elsewhere an fstream stands in, which is neither unbuffered nor safe to
+// share.
+class RandomAccessFile {
+private:
+    std::string path;
+    bool direct = false;
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+    int fd = -1;
+#else
+    mutable std::fstream stream;
+#endif
+
+public:
+    ~RandomAccessFile() {
+        close();
+    }
+
+    // With direct, ask for O_DIRECT so that reads and writes bypass the page
+    // cache; offsets, lengths and buffers must then be PAGE_SIZE aligned.
+    // Filesystems that refuse it get a buffered file instead.
+    bool open(const std::string& filePath, FileMode mode, bool directIo = false) {
+        close();
+        path = filePath;
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        int flags = mode == FileMode::ReadOnly ? O_RDONLY : O_RDWR | O_CREAT;
+        if (mode == FileMode::Truncate) flags |= O_TRUNC;
+        flags |= O_CLOEXEC;
+#ifdef O_DIRECT
+        if (directIo) {
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+#endif
+        if (fd < 0) fd = ::open(path.c_str(), flags, 0644);
+        return fd >= 0;
+#else
+        (void)directIo;
+        std::ios::openmode openMode = std::ios::in | std::ios::binary;
+        if (mode != FileMode::ReadOnly) openMode |= std::ios::out;
+        if (mode == FileMode::Truncate) openMode |= std::ios::trunc;
+        if (mode == FileMode::ReadWrite && !std::filesystem::exists(path)) {
+            std::ofstream(path, std::ios::out | std::ios::binary);
+        }
+        stream.open(path, openMode);
+        return stream.is_open();
+#endif
+    }
+
+    void close() {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#else
+        if (stream.is_open()) stream.close();
+#endif
+        direct = false;
+    }
+
+    bool isOpen() const {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        return fd >= 0;
+#else
+        return stream.is_open();
+#endif
+    }
+
+    // True if the file was opened with O_DIRECT
+    bool isDirect() const {
+        return direct;
+    }
+
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+    int descriptor() const {
+        return fd;
+    }
+#endif
+
+    // Reads exactly length bytes at offset; false on a short read
+    bool read(uint64_t offset, void* data, size_t length) const {
+        FILESTORAGE_TIME(Timer::FileRead);
+        FILESTORAGE_COUNT(Stat::BytesRead, length);
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        char* out = static_cast<char*>(data);
+        while (length > 0) {
+            ssize_t got = pread(fd, out, length, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            out += got;
+            offset += got;
+            length -= got;
+        }
+        return true;
+#else
+        stream.clear();
+        stream.seekg(offset, std::ios::beg);
+        stream.read(static_cast<char*>(data), length);
+        bool complete = stream.good();
+        stream.clear();
+        return complete;
+#endif
+    }
+
+    bool write(uint64_t offset, const void* data, size_t length) {
+        FILESTORAGE_TIME(Timer::FileWrite);
+        FILESTORAGE_COUNT(Stat::BytesWritten, length);
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        const char* in = static_cast<const char*>(data);
+        while (length > 0) {
+            ssize_t put = pwrite(fd, in, length, offset);
+            if (put < 0 && errno == EINTR) continue;
+            if (put <= 0) return false;
+            in += put;
+            offset += put;
+            length -= put;
+        }
+        return true;
+#else
+        stream.seekp(offset, std::ios::beg);
+        stream.write(static_cast<const char*>(data), length);
+        stream.flush();
+        return stream.good();
+#endif
+    }
+
+    // Push written data to the device; metadata other than the size may lag
+    bool sync() {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        while (fdatasync(fd) != 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+#else
+        stream.flush();
+        return stream.good();
+#endif
+    }
+
+    const std::string& name() const {
+        return path;
+    }
+
+    uint64_t size() const {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        struct stat st;
+        return fstat(fd, &st) == 0 ? st.st_size : 0;
+#else
+        stream.clear();
+        stream.seekg(0, std::ios::end);
+        return stream.tellg();
+#endif
+    }
+
+    bool truncate(uint64_t length) {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        return ftruncate(fd, length) == 0;
+#else
+        stream.close();
+        std::error_code error;
+        std::filesystem::resize_file(path, length, error);
+        stream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        return !error;
+#endif
+    }
+
+    // Tell the kernel how the file will be read; a no-op where unsupported
+    void adviseRandom() {
+#if defined(FILESTORAGE_HAVE_POSIX_IO) && defined(POSIX_FADV_RANDOM)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    }
+
+    void adviseSequential() {
+#if defined(FILESTORAGE_HAVE_POSIX_IO) && defined(POSIX_FADV_SEQUENTIAL)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+};
+
+// A failed write leaves the files behind what callers were told, so it ends
+// the process rather than carrying on
+inline void requireIo(bool ok, const std::string& path, const char* what) {
+    if (ok) return;
+    std::cerr << path << ": " << what << " failed: " << strerror(errno) << std::endl;
+    exit(1);
+}
+
+inline void requireIo(bool ok, const RandomAccessFile& file, const char* what) {
+    requireIo(ok, file.name(), what);
+}
+
+// Push a file written through a stream to the device
+inline bool syncPath(const std::string& path) {
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    (void)path;
+    return true;
+#endif
+}
+
+// Moves a completely written tmp over path. tmp reaches the device first,
+// so a crash leaves either the old file or the new one, never a torn one.
+inline void replaceFile(const std::string& tmp, const std::string& path) {
+    requireIo(syncPath(tmp), tmp, "fsync");
+    requireIo(std::rename(tmp.c_str(), path.c_str()) == 0, path, "rename");
+}
+
+// One transfer of an IoScheduler batch
+struct IoRequest {
+    RandomAccessFile* file;
+    uint64_t offset;
+    char* data;
+    uint32_t length;
+    bool write;
+    bool done;        // Set once every byte was transferred
+};
+
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+// Threads shared by every IoScheduler that has no io_uring
+class IoThreadPool {
+private:
+    static constexpr unsigned THREADS = 4;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    IoThreadPool() {
+        for (unsigned i = 0; i < THREADS; i++) {
+            threads.emplace_back([this] {
+                std::unique_lock<std::mutex> guard(lock);
+                while (true) {
+                    wake.wait(guard, [&] { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) return;
+                    std::function<void()> task = std::move(tasks.front());
+                    tasks.pop_front();
+                    guard.unlock();
+                    task();
+                    guard.lock();
+                }
+            });
+        }
+    }
+
+public:
+    ~IoThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : threads) worker.join();
+    }
+
+    static IoThreadPool& instance() {
+        static IoThreadPool pool;
+        return pool;
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+};
+#endif
+
+// Keeps up to QUEUE_DEPTH reads and writes in flight. Requests go to an
+// io_uring, set up with raw system calls, when the kernel offers one, and
+// otherwise to IoThreadPool; without POSIX I/O they simply run in turn on
+// the calling thread. A transfer the kernel cuts short is finished
+// synchronously. Not for concurrent use: one owner submits and waits.
+class IoScheduler {
+private:
+    static constexpr unsigned QUEUE_DEPTH = 64;
+
+    struct Slot {
+        IoRequest request;
+        IoRequest* origin;     // Marked done on completion; null for background writes
+#ifdef FILESTORAGE_HAVE_IO_URING
+        iovec buffer;
+#endif
+    };
+
+    std::array<Slot, QUEUE_DEPTH> slots;
+    std::vector<uint32_t> freeSlots;
+    size_t batchLeft = 0;
+    size_t backgroundLeft = 0;
+    bool backgroundFailed = false;
+    std::mutex lock;
+    std::condition_variable completed;
+
+#ifdef FILESTORAGE_HAVE_IO_URING
+    bool ringTried = false;
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    void* sqeArea = MAP_FAILED;
+    size_t sqRingBytes = 0;
+    size_t cqRingBytes = 0;
+    size_t sqeBytes = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned unsubmitted = 0;
+
+    void closeRing() {
+        if (sqeArea != MAP_FAILED) munmap(sqeArea, sqeBytes);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingBytes);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingBytes);
+        if (ringFd >= 0) ::close(ringFd);
+        sqRing = cqRing = sqeArea = MAP_FAILED;
+        ringFd = -1;
+    }
+
+    // Map the submission and completion rings; false leaves the pool in use
+    bool setupRing() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+        if (ringFd < 0) return false;
+
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqeArea = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeArea == MAP_FAILED) {
+            closeRing();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        sqes = static_cast<io_uring_sqe*>(sqeArea);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    bool ring() {
+        if (!ringTried) {
+            ringTried = true;
+            setupRing();
+        }
+        return ringFd >= 0;
+    }
+
+    // Every slot is at most one queued entry, so the queue cannot overflow
+    void queueOnRing(uint32_t index) {
+        Slot& slot = slots[index];
+        unsigned tail = *sqTail;
+        unsigned pos = tail & *sqMask;
+        io_uring_sqe& sqe = sqes[pos];
+        memset(&sqe, 0, sizeof(sqe));
+        slot.buffer.iov_base = slot.request.data;
+        slot.buffer.iov_len = slot.request.length;
+        sqe.opcode = slot.request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe.fd = slot.request.file->descriptor();
+        sqe.off = slot.request.offset;
+        sqe.addr = reinterpret_cast<uintptr_t>(&slot.buffer);
+        sqe.len = 1;
+        sqe.user_data = index;
+        sqArray[pos] = pos;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+    }
+
+    // Submit queued entries and wait for at least waitFor completions
+    void enterRing(unsigned waitFor) {
+        while (unsubmitted > 0 || waitFor > 0) {
+            long result = syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor,
+                                  waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            unsubmitted -= result;
+            return;
+        }
+    }
+
+    void reapRing() {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            // The pool path counts through RandomAccessFile instead
+            if (cqe.res > 0) {
+                FILESTORAGE_COUNT(slots[cqe.user_data].request.write ? Stat::BytesWritten : Stat::BytesRead, cqe.res);
+            }
+            complete(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+#endif
+
+    // Record the completion of a slot that moved the given number of bytes,
+    // negative on error (lock held)
+    void complete(uint32_t index, int64_t moved) {
+        const IoRequest& request = slots[index].request;
+        bool ok = moved >= 0;
+        if (ok && moved < request.length) {
+            uint64_t offset = request.offset + moved;
+            char* data = request.data + moved;
+            size_t length = request.length - moved;
+            ok = request.write ? request.file->write(offset, data, length) : request.file->read(offset, data, length);
+        }
+
+        if (slots[index].origin != nullptr) {
+            slots[index].origin->done = ok;
+            batchLeft--;
+        } else {
+            backgroundFailed |= !ok;
+            backgroundLeft--;
+        }
+        freeSlots.push_back(index);
+        completed.notify_all();
+    }
+
+    void dispatch(uint32_t index) {
+#ifdef FILESTORAGE_HAVE_IO_URING
+        if (ring()) {
+            queueOnRing(index);
+            return;
+        }
+#endif
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        IoThreadPool::instance().post([this, index] {
+            const IoRequest& request = slots[index].request;
+            bool ok = request.write ? request.file->write(request.offset, request.data, request.length)
+                                    : request.file->read(request.offset, request.data, request.length);
+            std::lock_guard<std::mutex> guard(lock);
+            complete(index, ok ? request.length : -1);
+        });
+#else
+        const IoRequest& request = slots[index].request;
+        bool ok = request.write ? request.file->write(request.offset, request.data, request.length)
+                                : request.file->read(request.offset, request.data, request.length);
+        complete(index, ok ? request.length : -1);
+#endif
+    }
+
+    void submitQueued() {
+#ifdef FILESTORAGE_HAVE_IO_URING
+        if (ringFd >= 0 && unsubmitted > 0) enterRing(0);
+#endif
+    }
+
+    template <typename Done>
+    void waitUntil(std::unique_lock<std::mutex>& guard, Done done) {
+#ifdef FILESTORAGE_HAVE_IO_URING
+        if (ringFd >= 0) {
+            while (true) {
+                reapRing();
+                if (done()) return;
+                enterRing(1);
+            }
+        }
+#endif
+        completed.wait(guard, done);
+    }
+
+    uint32_t acquireSlot(std::unique_lock<std::mutex>& guard) {
+        waitUntil(guard, [&] { return !freeSlots.empty(); });
+        uint32_t index = freeSlots.back();
+        freeSlots.pop_back();
+        return index;
+    }
+
+public:
+    IoScheduler() {
+        for (uint32_t i = QUEUE_DEPTH; i > 0; i--) freeSlots.push_back(i - 1);
+    }
+
+    ~IoScheduler() {
+        finishWrites();
+#ifdef FILESTORAGE_HAVE_IO_URING
+        closeRing();
+#endif
+    }
+
+    IoScheduler(const IoScheduler&) = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    // Run every request, keeping as many in flight as the queue allows, and
+    // wait for all of them; each one's done flag tells whether it succeeded
+    void run(IoRequest* requests, size_t count) {
+        FILESTORAGE_TIME(Timer::IoBatch);
+        std::unique_lock<std::mutex> guard(lock);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t index = acquireSlot(guard);
+            requests[i].done = false;
+            slots[index].request = requests[i];
+            slots[index].origin = &requests[i];
+            batchLeft++;
+            dispatch(index);
+        }
+        submitQueued();
+        waitUntil(guard, [&] { return batchLeft == 0; });
+    }
+
+    // Start writing length bytes at offset and return at once. data must
+    // stay untouched until finishWrites().
+    void startWrite(RandomAccessFile& file, uint64_t offset, const char* data, size_t length) {
+        std::unique_lock<std::mutex> guard(lock);
+        uint32_t index = acquireSlot(guard);
+        slots[index].request = IoRequest{&file, offset, const_cast<char*>(data), static_cast<uint32_t>(length), true, false};
+        slots[index].origin = nullptr;
+        backgroundLeft++;
+        dispatch(index);
+        submitQueued();
+    }
+
+    // Wait for every started write; false if any of them failed
+    bool finishWrites() {
+        std::unique_lock<std::mutex> guard(lock);
+        submitQueued();
+        waitUntil(guard, [&] { return backgroundLeft == 0; });
+        bool ok = !backgroundFailed;
+        backgroundFailed = false;
+        return ok;
+    }
+};
+
+// Fixed-size page I/O on the index file, through an LRU buffer pool of at
+// most cacheBytes. Writes only dirty the cached copy; dirty pages reach the
+// file when they are evicted or on flush().
+class Pager {
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Frame {
+        uint32_t id;
+        bool dirty;
+        uint32_t prev;    // Towards the most recently used frame
+        uint32_t next;    // Towards the least recently used frame
+        Page* page;       // In pages, so aligned for O_DIRECT
+    };
+
+    RandomAccessFile file;
+    std::unique_ptr<AlignedPage> bounce;   // Staging page when the file is O_DIRECT
+    size_t capacity = 0;
+    std::unique_ptr<AlignedPage[]> pages;  // One per frame, left untouched until used
+    std::vector<std::unique_ptr<Frame>> frames;
+    std::unordered_map<uint32_t, uint32_t> lookup;  // Page id -> frame
+    uint32_t mostRecent = NONE;
+    uint32_t leastRecent = NONE;
+
+    static bool aligned(const Page& page) {
+        return reinterpret_cast<uintptr_t>(page.raw) % PAGE_SIZE == 0;
+    }
+
+    bool readFromFile(uint32_t id, Page& page) {
+        uint64_t offset = static_cast<uint64_t>(id) * PAGE_SIZE;
+        if (!bounce || aligned(page)) return file.read(offset, page.raw, PAGE_SIZE);
+        if (!file.read(offset, bounce->page.raw, PAGE_SIZE)) return false;
+        memcpy(page.raw, bounce->page.raw, PAGE_SIZE);
+        return true;
+    }
+
+    void writeToFile(uint32_t id, const Page& page) {
+        FILESTORAGE_COUNT(Stat::PageWritebacks, 1);
+        uint64_t offset = static_cast<uint64_t>(id) * PAGE_SIZE;
+        if (!bounce || aligned(page)) {
+            requireIo(file.write(offset, page.raw, PAGE_SIZE), file, "index page write");
+            return;
+        }
+        memcpy(bounce->page.raw, page.raw, PAGE_SIZE);
+        requireIo(file.write(offset, bounce->page.raw, PAGE_SIZE), file, "index page write");
+    }
+
+    void detach(uint32_t slot) {
+        Frame& frame = *frames[slot];
+        if (frame.prev != NONE) frames[frame.prev]->next = frame.next;
+        else mostRecent = frame.next;
+        if (frame.next != NONE) frames[frame.next]->prev = frame.prev;
+        else leastRecent = frame.prev;
+    }
+
+    void attachFront(uint32_t slot) {
+        Frame& frame = *frames[slot];
+        frame.prev = NONE;
+        frame.next = mostRecent;
+        if (mostRecent != NONE) frames[mostRecent]->prev = slot;
+        mostRecent = slot;
+        if (leastRecent == NONE) leastRecent = slot;
+    }
+
+    // Returns a frame assigned to page id, evicting the least recently used
+    // page (and writing it back if dirty) when the pool is full
+    uint32_t claimFrame(uint32_t id) {
+        uint32_t slot;
+        if (frames.size() < capacity) {
+            frames.emplace_back(new Frame);
+            slot = frames.size() - 1;
+            frames[slot]->page = &pages[slot].page;
+        } else {
+            slot = leastRecent;
+            detach(slot);
+            Frame& victim = *frames[slot];
+            if (victim.id != NONE) {
+                if (victim.dirty) writeToFile(victim.id, *victim.page);
+                lookup.erase(victim.id);
+            }
+        }
+
+        Frame& frame = *frames[slot];
+        frame.id = id;
+        frame.dirty = false;
+        lookup[id] = slot;
+        attachFront(slot);
+        return slot;
+    }
+
+    // Unassign a frame whose page could not be read and make it the first
+    // to be reused
+    void discardFrame(uint32_t slot) {
+        Frame& frame = *frames[slot];
+        lookup.erase(frame.id);
+        frame.id = NONE;
+        detach(slot);
+        frame.prev = leastRecent;
+        frame.next = NONE;
+        if (leastRecent != NONE) frames[leastRecent]->next = slot;
+        else mostRecent = slot;
+        leastRecent = slot;
+    }
+
+    // Returns the frame caching page id, or NONE, and marks it most recent
+    uint32_t touch(uint32_t id) {
+        auto it = lookup.find(id);
+        if (it == lookup.end()) return NONE;
+        if (it->second != mostRecent) {
+            detach(it->second);
+            attachFront(it->second);
+        }
+        return it->second;
+    }
+
+public:
+    // Returns false if the file had to be created. With direct, pages
+    // bypass the OS cache, leaving the pool as the only cache.
+    bool open(const std::string& path, size_t cacheBytes, bool direct = false) {
+        capacity = cacheBytes / PAGE_SIZE;
+        pages.reset(capacity > 0 ? new AlignedPage[capacity] : nullptr);
+
+        std::ifstream testFile(path);
+        bool fileExists = testFile.good();
+        testFile.close();
+
+        file.open(path, fileExists ? FileMode::ReadWrite : FileMode::Truncate, direct);
+        if (file.isDirect()) bounce = std::make_unique<AlignedPage>();
+        // Page reads follow the tree, not the file order
+        file.adviseRandom();
+        return fileExists;
+    }
+
+    void close() {
+        flush();
+        frames.clear();
+        pages.reset();
+        lookup.clear();
+        mostRecent = leastRecent = NONE;
+        file.close();
+        bounce.reset();
+    }
+
+    bool read(uint32_t id, Page& page) {
+        if (capacity == 0) {
+            FILESTORAGE_COUNT(Stat::PageMisses, 1);
+            return readFromFile(id, page);
+        }
+
+        uint32_t slot = touch(id);
+        FILESTORAGE_COUNT(slot == NONE ? Stat::PageMisses : Stat::PageHits, 1);
+        if (slot == NONE) {
+            slot = claimFrame(id);
+            if (!readFromFile(id, *frames[slot]->page)) {
+                discardFrame(slot);
+                return false;
+            }
+        }
+        memcpy(page.raw, frames[slot]->page->raw, PAGE_SIZE);
+        return true;
+    }
+
+    // The cached copy of page id, or null; valid until the next call
+    const Page* cached(uint32_t id) {
+        uint32_t slot = touch(id);
+        return slot == NONE ? nullptr : frames[slot]->page;
+    }
+
+    // Read the uncached pages among ids into the pool in one batch. At most
+    // half the pool is claimed, so the batch cannot evict its own pages.
+    void prefetch(const std::vector<uint32_t>& ids, IoScheduler& io) {
+        std::vector<IoRequest> requests;
+        std::vector<uint32_t> requestSlots;
+        for (uint32_t id : ids) {
+            if (requests.size() >= capacity / 2) break;
+            if (lookup.count(id) > 0) continue;
+            uint32_t slot = claimFrame(id);
+            requests.push_back(IoRequest{&file, static_cast<uint64_t>(id) * PAGE_SIZE,
+                                         frames[slot]->page->raw, PAGE_SIZE, false, false});
+            requestSlots.push_back(slot);
+        }
+
+        io.run(requests.data(), requests.size());
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (!requests[i].done) discardFrame(requestSlots[i]);
+        }
+    }
+
+    void write(uint32_t id, const Page& page) {
+        if (capacity == 0) {
+            writeToFile(id, page);
+            return;
+        }
+
+        uint32_t slot = touch(id);
+        if (slot == NONE) slot = claimFrame(id);
+        Frame& frame = *frames[slot];
+        memcpy(frame.page->raw, page.raw, PAGE_SIZE);
+        frame.dirty = true;
+    }
+
+    // Write back all dirty pages in page order
+    void flush() {
+        std::vector<uint32_t> dirty;
+        for (uint32_t slot = 0; slot < frames.size(); slot++) {
+            if (frames[slot]->id != NONE && frames[slot]->dirty) dirty.push_back(slot);
+        }
+        std::sort(dirty.begin(), dirty.end(), [&](uint32_t a, uint32_t b) {
+            return frames[a]->id < frames[b]->id;
+        });
+        for (uint32_t slot : dirty) {
+            writeToFile(frames[slot]->id, *frames[slot]->page);
+            frames[slot]->dirty = false;
+        }
+    }
+};
+
+// Page-based B+ tree over (index, value) keys. Besides the pager's bounded
+// cache, only the pages on the current root-to-leaf path are held in memory.
+class BPlusTree {
+private:
+    Pager pager;
+    MetaPage meta;
+
+    struct Split {
+        bool happened = false;
+        Key separator;
+        uint32_t right = 0;
+        uint32_t rightEntries = 0;   // Entries under the new right node
+    };
+
+    // (first key, page, entries below it) of a node built by bulkLoad
+    struct BulkNode {
+        Key first;
+        uint32_t page;
+        uint64_t entries;
+    };
+
+    uint32_t allocatePage() {
+        if (meta.freeList != 0) {
+            uint32_t id = meta.freeList;
+            Page page;
+            pager.read(id, page);
+            meta.freeList = page.leaf.next;
+            return id;
+        }
+        return meta.pageCount++;
+    }
+
+    void freePage(uint32_t id) {
+        Page page;
+        memset(page.raw, 0, PAGE_SIZE);
+        page.leaf.type = PAGE_FREE;
+        page.leaf.next = meta.freeList;
+        pager.write(id, page);
+        meta.freeList = id;
+    }
+
+    void initLeaf(Page& page) {
+        memset(page.raw, 0, PAGE_SIZE);
+        page.leaf.type = PAGE_LEAF;
+    }
+
+    void initInner(Page& page) {
+        memset(page.raw, 0, PAGE_SIZE);
+        page.inner.type = PAGE_INNER;
+    }
+
+    // Number of separators <= key, i.e. the child that may hold key
+    static uint32_t childSlot(const InnerPage& inner, const Key& key) {
+        return searchKeys(inner.keys, sizeof(Key), inner.count, key, true);
+    }
+
+    // First position in the leaf whose key is >= key
+    static uint32_t leafSlot(const LeafPage& leaf, const Key& key) {
+        return searchKeys(&leaf.entries[0].key, sizeof(Entry), leaf.count, key, false);
+    }
+
+    static uint64_t subtreeEntries(const InnerPage& inner) {
+        uint64_t entries = 0;
+        for (uint32_t i = 0; i <= inner.count; i++) entries += inner.counts[i];
+        return entries;
+    }
+
+    bool insertInto(uint32_t id, const Entry& entry, Split& split) {
+        const Key& key = entry.key;
+        Page page;
+        pager.read(id, page);
+
+        if (page.leaf.type == PAGE_LEAF) {
+            LeafPage& leaf = page.leaf;
+            uint32_t pos = leafSlot(leaf, key);
+            if (pos < leaf.count && compareKeys(leaf.entries[pos].key, key) == 0) {
+                return false;  // Already exists
+            }
+
+            if (leaf.count < LEAF_CAPACITY) {
+                memmove(&leaf.entries[pos + 1], &leaf.entries[pos], (leaf.count - pos) * sizeof(Entry));
+                leaf.entries[pos] = entry;
+                leaf.count++;
+                pager.write(id, page);
+                return true;
+            }
+
+            // Split a full leaf, the upper half moves to a new right sibling
+            Entry all[LEAF_CAPACITY + 1];
+            memcpy(all, leaf.entries, pos * sizeof(Entry));
+            all[pos] = entry;
+            memcpy(all + pos + 1, leaf.entries + pos, (leaf.count - pos) * sizeof(Entry));
+
+            uint32_t total = LEAF_CAPACITY + 1;
+            uint32_t leftCount = total / 2;
+
+            Page right;
+            initLeaf(right);
+            uint32_t rightId = allocatePage();
+            right.leaf.count = total - leftCount;
+            memcpy(right.leaf.entries, all + leftCount, right.leaf.count * sizeof(Entry));
+            right.leaf.next = leaf.next;
+
+            leaf.count = leftCount;
+            memcpy(leaf.entries, all, leftCount * sizeof(Entry));
+            leaf.next = rightId;
+
+            pager.write(id, page);
+            pager.write(rightId, right);
+
+            split.happened = true;
+            split.separator = right.leaf.entries[0].key;
+            split.right = rightId;
+            split.rightEntries = right.leaf.count;
+            return true;
+        }
+
+        InnerPage& inner = page.inner;
+        uint32_t slot = childSlot(inner, key);
+        Split childSplit;
+        if (!insertInto(inner.children[slot], entry, childSplit)) {
+            return false;
+        }
+        inner.counts[slot]++;
+        if (!childSplit.happened) {
+            pager.write(id, page);
+            return true;
+        }
+        inner.counts[slot] -= childSplit.rightEntries;
+
+        if (inner.count < INNER_CAPACITY) {
+            memmove(&inner.keys[slot + 1], &inner.keys[slot], (inner.count - slot) * sizeof(Key));
+            memmove(&inner.children[slot + 2], &inner.children[slot + 1], (inner.count - slot) * sizeof(uint32_t));
+            memmove(&inner.counts[slot + 2], &inner.counts[slot + 1], (inner.count - slot) * sizeof(uint32_t));
+            inner.keys[slot] = childSplit.separator;
+            inner.children[slot + 1] = childSplit.right;
+            inner.counts[slot + 1] = childSplit.rightEntries;
+            inner.count++;
+            pager.write(id, page);
+            return true;
+        }
+
+        // Split a full inner node, the middle separator moves up
+        Key keys[INNER_CAPACITY + 1];
+        uint32_t children[INNER_CAPACITY + 2];
+        uint32_t counts[INNER_CAPACITY + 2];
+        memcpy(keys, inner.keys, slot * sizeof(Key));
+        keys[slot] = childSplit.separator;
+        memcpy(keys + slot + 1, inner.keys + slot, (inner.count - slot) * sizeof(Key));
+        memcpy(children, inner.children, (slot + 1) * sizeof(uint32_t));
+        children[slot + 1] = childSplit.right;
+        memcpy(children + slot + 2, inner.children + slot + 1, (inner.count - slot) * sizeof(uint32_t));
+        memcpy(counts, inner.counts, (slot + 1) * sizeof(uint32_t));
+        counts[slot + 1] = childSplit.rightEntries;
+        memcpy(counts + slot + 2, inner.counts + slot + 1, (inner.count - slot) * sizeof(uint32_t));
+
+        uint32_t total = INNER_CAPACITY + 1;
+        uint32_t leftCount = total / 2;
+
+        Page right;
+        initInner(right);
+        uint32_t rightId = allocatePage();
+        right.inner.count = total - leftCount - 1;
+        memcpy(right.inner.keys, keys + leftCount + 1, right.inner.count * sizeof(Key));
+        memcpy(right.inner.children, children + leftCount + 1, (right.inner.count + 1) * sizeof(uint32_t));
+        memcpy(right.inner.counts, counts + leftCount + 1, (right.inner.count + 1) * sizeof(uint32_t));
+
+        inner.count = leftCount;
+        memcpy(inner.keys, keys, leftCount * sizeof(Key));
+        memcpy(inner.children, children, (leftCount + 1) * sizeof(uint32_t));
+        memcpy(inner.counts, counts, (leftCount + 1) * sizeof(uint32_t));
+
+        pager.write(id, page);
+        pager.write(rightId, right);
+
+        split.happened = true;
+        split.separator = keys[leftCount];
+        split.right = rightId;
+        split.rightEntries = subtreeEntries(right.inner);
+        return true;
+    }
+
+    // Refill parent.children[slot] after it dropped below the minimum, by
+    // borrowing from a sibling or merging with one
+    void fixChild(Page& parentPage, uint32_t slot) {
+        InnerPage& parent = parentPage.inner;
+        uint32_t leftSlot = slot > 0 ? slot - 1 : slot;
+        uint32_t leftId = parent.children[leftSlot];
+        uint32_t rightId = parent.children[leftSlot + 1];
+
+        Page leftPage, rightPage;
+        pager.read(leftId, leftPage);
+        pager.read(rightId, rightPage);
+        bool childIsLeft = (leftSlot == slot);
+        Key& separator = parent.keys[leftSlot];
+        uint32_t& leftEntries = parent.counts[leftSlot];
+        uint32_t& rightEntries = parent.counts[leftSlot + 1];
+
+        if (leftPage.leaf.type == PAGE_LEAF) {
+            LeafPage& left = leftPage.leaf;
+            LeafPage& right = rightPage.leaf;
+
+            if (childIsLeft && right.count > LEAF_MIN) {
+                left.entries[left.count++] = right.entries[0];
+                right.count--;
+                memmove(&right.entries[0], &right.entries[1], right.count * sizeof(Entry));
+                separator = right.entries[0].key;
+                leftEntries++;
+                rightEntries--;
+            } else if (!childIsLeft && left.count > LEAF_MIN) {
+                memmove(&right.entries[1], &right.entries[0], right.count * sizeof(Entry));
+                right.entries[0] = left.entries[--left.count];
+                right.count++;
+                separator = right.entries[0].key;
+                leftEntries--;
+                rightEntries++;
+            } else {
+                memcpy(&left.entries[left.count], right.entries, right.count * sizeof(Entry));
+                left.count += right.count;
+                left.next = right.next;
+                leftEntries += rightEntries;
+                pager.write(leftId, leftPage);
+                freePage(rightId);
+                removeSeparator(parent, leftSlot);
+                return;
+            }
+        } else {
+            InnerPage& left = leftPage.inner;
+            InnerPage& right = rightPage.inner;
+
+            // A child moving between siblings takes its subtree's entries along
+            if (childIsLeft && right.count > INNER_MIN) {
+                uint32_t moved = right.counts[0];
+                left.keys[left.count] = separator;
+                left.children[left.count + 1] = right.children[0];
+                left.counts[left.count + 1] = moved;
+                left.count++;
+                separator = right.keys[0];
+                right.count--;
+                memmove(&right.keys[0], &right.keys[1], right.count * sizeof(Key));
+                memmove(&right.children[0], &right.children[1], (right.count + 1) * sizeof(uint32_t));
+                memmove(&right.counts[0], &right.counts[1], (right.count + 1) * sizeof(uint32_t));
+                leftEntries += moved;
+                rightEntries -= moved;
+            } else if (!childIsLeft && left.count > INNER_MIN) {
+                uint32_t moved = left.counts[left.count];
+                memmove(&right.keys[1], &right.keys[0], right.count * sizeof(Key));
+                memmove(&right.children[1], &right.children[0], (right.count + 1) * sizeof(uint32_t));
+                memmove(&right.counts[1], &right.counts[0], (right.count + 1) * sizeof(uint32_t));
+                right.keys[0] = separator;
+                right.children[0] = left.children[left.count];
+                right.counts[0] = moved;
+                right.count++;
+                separator = left.keys[left.count - 1];
+                left.count--;
+                leftEntries -= moved;
+                rightEntries += moved;
+            } else {
+                left.keys[left.count] = separator;
+                memcpy(&left.keys[left.count + 1], right.keys, right.count * sizeof(Key));
+                memcpy(&left.children[left.count + 1], right.children, (right.count + 1) * sizeof(uint32_t));
+                memcpy(&left.counts[left.count + 1], right.counts, (right.count + 1) * sizeof(uint32_t));
+                left.count += right.count + 1;
+                leftEntries += rightEntries;
+                pager.write(leftId, leftPage);
+                freePage(rightId);
+                removeSeparator(parent, leftSlot);
+                return;
+            }
+        }
+
+        pager.write(leftId, leftPage);
+        pager.write(rightId, rightPage);
+    }
+
+    // Drop keys[slot] and children[slot + 1] after a merge
+    static void removeSeparator(InnerPage& parent, uint32_t slot) {
+        memmove(&parent.keys[slot], &parent.keys[slot + 1], (parent.count - slot - 1) * sizeof(Key));
+        memmove(&parent.children[slot + 1], &parent.children[slot + 2], (parent.count - slot - 1) * sizeof(uint32_t));
+        memmove(&parent.counts[slot + 1], &parent.counts[slot + 2], (parent.count - slot - 1) * sizeof(uint32_t));
+        parent.count--;
+    }
+
+    // Returns true if the key was removed and stores its record offset;
+    // underflow reports whether the page is now below its minimum fill
+    bool eraseFrom(uint32_t id, const Key& key, uint64_t& offset, bool& underflow) {
+        Page page;
+        pager.read(id, page);
+
+        if (page.leaf.type == PAGE_LEAF) {
+            LeafPage& leaf = page.leaf;
+            uint32_t pos = leafSlot(leaf, key);
+            if (pos >= leaf.count || compareKeys(leaf.entries[pos].key, key) != 0) {
+                return false;
+            }
+            offset = leaf.entries[pos].offset;
+            leaf.count--;
+            memmove(&leaf.entries[pos], &leaf.entries[pos + 1], (leaf.count - pos) * sizeof(Entry));
+            pager.write(id, page);
+            underflow = leaf.count < LEAF_MIN;
+            return true;
+        }
+
+        InnerPage& inner = page.inner;
+        uint32_t slot = childSlot(inner, key);
+        bool childUnderflow = false;
+        if (!eraseFrom(inner.children[slot], key, offset, childUnderflow)) {
+            return false;
+        }
+        inner.counts[slot]--;
+        if (childUnderflow) fixChild(page, slot);
+        pager.write(id, page);
+        underflow = inner.count < INNER_MIN;
+        return true;
+    }
+
+    void writeMeta() {
+        Page page;
+        memset(page.raw, 0, PAGE_SIZE);
+        page.meta = meta;
+        pager.write(0, page);
+    }
+
+public:
+    // Opens the index file. Returns true if it holds a cleanly closed index
+    // for a data file of logBytes bytes; otherwise the caller must reset()
+    // and rebuild it.
+    bool open(const std::string& path, uint64_t logBytes, size_t cacheBytes, bool directIo = false) {
+        bool usable = false;
+        if (pager.open(path, cacheBytes, directIo)) {
+            Page page;
+            if (pager.read(0, page)) {
+                meta = page.meta;
+                usable = meta.magic == INDEX_MAGIC && meta.version == INDEX_VERSION &&
+                         meta.dirty == 0 && meta.logBytes == logBytes;
+            }
+        }
+        if (usable) {
+            // A crash from here on leaves dirty set, forcing a rebuild
+            meta.dirty = 1;
+            writeMeta();
+            pager.flush();
+        }
+        return usable;
+    }
+
+    // Discard all pages and start from an empty root leaf
+    void reset() {
+        memset(&meta, 0, sizeof(meta));
+        meta.magic = INDEX_MAGIC;
+        meta.version = INDEX_VERSION;
+        meta.dirty = 1;
+        meta.pageCount = 1;
+        meta.root = allocatePage();
+
+        Page root;
+        initLeaf(root);
+        pager.write(meta.root, root);
+        writeMeta();
+        pager.flush();
+    }
+
+    // Replace the tree with count entries that next(entry) produces in
+    // ascending key order. Leaves are filled left to right, then each inner
+    // level is built from the first keys of the level below it.
+    template <typename Next>
+    void bulkLoad(uint64_t count, Next next) {
+        reset();
+        if (count == 0) return;
+
+        // The nodes of the level just built
+        std::vector<BulkNode> level;
+        uint64_t leaves = (count + BULK_LEAF_FILL - 1) / BULK_LEAF_FILL;
+        level.reserve(leaves);
+
+        uint32_t id = meta.root;
+        for (uint64_t i = 0; i < leaves; i++) {
+            Page page;
+            initLeaf(page);
+            // Spread the entries evenly so the last leaf is not left nearly empty
+            page.leaf.count = count * (i + 1) / leaves - count * i / leaves;
+            for (uint32_t pos = 0; pos < page.leaf.count; pos++) {
+                next(page.leaf.entries[pos]);
+            }
+            page.leaf.next = i + 1 < leaves ? allocatePage() : 0;
+            pager.write(id, page);
+            level.push_back(BulkNode{page.leaf.entries[0].key, id, page.leaf.count});
+            id = page.leaf.next;
+        }
+
+        while (level.size() > 1) {
+            uint64_t children = level.size();
+            uint64_t nodes = (children + BULK_INNER_FILL) / (BULK_INNER_FILL + 1);
+            std::vector<BulkNode> parents;
+            parents.reserve(nodes);
+            for (uint64_t i = 0; i < nodes; i++) {
+                uint64_t first = children * i / nodes;
+                uint64_t last = children * (i + 1) / nodes;
+
+                Page page;
+                initInner(page);
+                page.inner.count = last - first - 1;
+                uint64_t entries = 0;
+                for (uint64_t child = first; child < last; child++) {
+                    if (child > first) page.inner.keys[child - first - 1] = level[child].first;
+                    page.inner.children[child - first] = level[child].page;
+                    page.inner.counts[child - first] = level[child].entries;
+                    entries += level[child].entries;
+                }
+                uint32_t parentId = allocatePage();
+                pager.write(parentId, page);
+                parents.push_back(BulkNode{level[first].first, parentId, entries});
+            }
+            level.swap(parents);
+        }
+
+        meta.root = level[0].page;
+        meta.entryCount = count;
+    }
+
+    uint64_t deadBytes() const {
+        return meta.deadBytes;
+    }
+
+    uint64_t entryCount() const {
+        return meta.entryCount;
+    }
+
+    // Marks the index clean for a data file of logBytes bytes, deadBytes of
+    // which belong to deleted records
+    void close(uint64_t logBytes, uint64_t deadBytes) {
+        meta.dirty = 0;
+        meta.logBytes = logBytes;
+        meta.deadBytes = deadBytes;
+        writeMeta();
+        pager.close();
+    }
+
+    // Returns false if the key is already present
+    bool insert(const Key& key, uint64_t offset) {
+        Entry entry;
+        entry.key = key;
+        entry.reserved = 0;
+        entry.offset = offset;
+
+        Split split;
+        if (!insertInto(meta.root, entry, split)) {
+            return false;
+        }
+        if (split.happened) {
+            Page root;
+            initInner(root);
+            root.inner.count = 1;
+            root.inner.keys[0] = split.separator;
+            root.inner.children[0] = meta.root;
+            root.inner.children[1] = split.right;
+            root.inner.counts[0] = meta.entryCount + 1 - split.rightEntries;
+            root.inner.counts[1] = split.rightEntries;
+            meta.root = allocatePage();
+            pager.write(meta.root, root);
+        }
+        meta.entryCount++;
+        return true;
+    }
+
+    // Returns false if the key is not present, otherwise stores the offset
+    // of the key's record
+    bool erase(const Key& key, uint64_t& offset) {
+        bool underflow = false;
+        if (!eraseFrom(meta.root, key, offset, underflow)) {
+            return false;
+        }
+
+        // Collapse a root that has been merged down to a single child
+        Page root;
+        pager.read(meta.root, root);
+        if (root.inner.type == PAGE_INNER && root.inner.count == 0) {
+            uint32_t oldRoot = meta.root;
+            meta.root = root.inner.children[0];
+            freePage(oldRoot);
+        }
+        meta.entryCount--;
+        return true;
+    }
+
+    // Number of entries below key, or up to and including it, summed from
+    // the subtree counts along one root-to-leaf path
+    uint64_t rank(const Key& key, bool inclusive) {
+        uint64_t below = 0;
+        Page page;
+        pager.read(meta.root, page);
+        while (page.inner.type == PAGE_INNER) {
+            uint32_t slot = childSlot(page.inner, key);
+            for (uint32_t i = 0; i < slot; i++) below += page.inner.counts[i];
+            pager.read(page.inner.children[slot], page);
+        }
+        return below + searchKeys(&page.leaf.entries[0].key, sizeof(Entry), page.leaf.count, key, inclusive);
+    }
+
+    bool contains(const Key& key) {
+        Page page;
+        pager.read(meta.root, page);
+        while (page.inner.type == PAGE_INNER) {
+            pager.read(page.inner.children[childSlot(page.inner, key)], page);
+        }
+        uint32_t pos = leafSlot(page.leaf, key);
+        return pos < page.leaf.count && compareKeys(page.leaf.entries[pos].key, key) == 0;
+    }
+
+    // Calls visit(entry) for each entry with key >= from in ascending order
+    // until it returns false
+    template <typename Visitor>
+    void scan(const Key& from, Visitor visit) {
+        Page page;
+        uint32_t id = meta.root;
+        pager.read(id, page);
+        while (page.inner.type == PAGE_INNER) {
+            id = page.inner.children[childSlot(page.inner, from)];
+            pager.read(id, page);
+        }
+
+        uint32_t pos = leafSlot(page.leaf, from);
+        while (true) {
+            for (; pos < page.leaf.count; pos++) {
+                if (!visit(page.leaf.entries[pos])) return;
+            }
+            if (page.leaf.next == 0) return;
+            pager.read(page.leaf.next, page);
+            pos = 0;
+        }
+    }
+
+    // Forward iterator over the entries in key order. It holds a copy of one
+    // leaf, so it is only valid while the tree is left unmodified.
+    class Cursor {
+    private:
+        friend class BPlusTree;
+
+        Pager* pager = nullptr;
+        Page page;
+        uint32_t pos = 0;
+
+        void skipExhausted() {
+            while (pos >= page.leaf.count && page.leaf.next != 0) {
+                pager->read(page.leaf.next, page);
+                pos = 0;
+            }
+        }
+
+    public:
+        bool valid() const {
+            return pos < page.leaf.count;
+        }
+
+        const Entry& entry() const {
+            return page.leaf.entries[pos];
+        }
+
+        void next() {
+            pos++;
+            skipExhausted();
+        }
+    };
+
+    // Cursor at the first entry with key >= from
+    Cursor seek(const Key& from) {
+        Cursor cursor;
+        cursor.pager = &pager;
+        pager.read(meta.root, cursor.page);
+        while (cursor.page.inner.type == PAGE_INNER) {
+            pager.read(cursor.page.inner.children[childSlot(cursor.page.inner, from)], cursor.page);
+        }
+        cursor.pos = leafSlot(cursor.page.leaf, from);
+        cursor.skipExhausted();
+        return cursor;
+    }
+
+    // Pull the root-to-leaf paths of keys into the page cache one level at
+    // a time, reading each level's missing pages as one batch
+    void prefetch(const std::vector<Key>& keys, IoScheduler& io) {
+        std::vector<std::pair<uint32_t, const Key*>> paths;   // Page on the path, key
+        for (const Key& key : keys) paths.emplace_back(meta.root, &key);
+
+        std::vector<uint32_t> ids;
+        while (!paths.empty()) {
+            ids.clear();
+            for (auto& path : paths) ids.push_back(path.first);
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            pager.prefetch(ids, io);
+
+            size_t kept = 0;
+            for (auto& path : paths) {
+                const Page* page = pager.cached(path.first);
+                if (page == nullptr || page->inner.type != PAGE_INNER) continue;
+                paths[kept++] = {page->inner.children[childSlot(page->inner, *path.second)], path.second};
+            }
+            paths.resize(kept);
+        }
+    }
+
+    // Visits every entry in ascending order and replaces its offset with
+    // relocate(entry), writing each leaf back once
+    template <typename Relocate>
+    void rewriteOffsets(Relocate relocate) {
+        Page page;
+        uint32_t id = meta.root;
+        pager.read(id, page);
+        while (page.inner.type == PAGE_INNER) {
+            id = page.inner.children[0];
+            pager.read(id, page);
+        }
+
+        while (true) {
+            for (uint32_t pos = 0; pos < page.leaf.count; pos++) {
+                page.leaf.entries[pos].offset = relocate(page.leaf.entries[pos]);
+            }
+            pager.write(id, page);
+            if (page.leaf.next == 0) return;
+            id = page.leaf.next;
+            pager.read(id, page);
+        }
+    }
+};
+
+// When buffered data file writes are pushed to the OS
+enum class Durability {
+    PerOp,     // After every insert/delete, and synced to disk before it returns
+    Periodic,  // Every flushEveryOps writes or flushIntervalMs, whichever first
+    OnExit     // Only when the write buffer fills and at shutdown
+};
+
+enum class StorageEngine {
+    BTree,  // FileStorage: update-in-place tree over the data log
+    Lsm,    // LsmStorage: memtable and leveled sorted runs
+};
+
+// Appended records are buffered up to this many bytes before a write
+const size_t WRITE_BUFFER_BYTES = 64 << 10;
+// Tombstones for already written records are queued up to this count
+const size_t MAX_PENDING_TOMBSTONES = 4096;
+
+// Tunables for FileStorage
+struct StorageOptions {
+    // Compact the data file once deleted records make up more than this
+    // fraction of it...
+    double compactRatio = 0.5;
+    // ...and at least this many bytes
+    uint64_t compactMinBytes = 1 << 20;
+
+    // Memory budget for cached index pages
+    size_t cacheBytes = 512 << 10;
+
+    // Working memory of recovery and bulk loads on top of the page cache,
+    // kept to half of it so neither peaks far above normal operation
+    size_t scratchBytes() const {
+        return cacheBytes / 2;
+    }
+
+    Durability durability = Durability::Periodic;
+    uint32_t flushEveryOps = 4096;
+    uint32_t flushIntervalMs = 50;
+
+    // Checkpoint the index once this many bytes were appended to the data
+    // file since the last checkpoint, 0 = never. Recovery after a crash
+    // replays only the records past the checkpoint.
+    uint64_t checkpointBytes = 4 << 20;
+
+    // Threads for a full replay of the data file. Above 1 the replay holds
+    // every live record in memory while it sorts them.
+    unsigned recoveryThreads = 1;
+
+    // Stores a ShardedStorage spreads indexes over. Must stay the same for
+    // the lifetime of the files.
+    unsigned shards = 1;
+
+    // Per-shard slots for the immutable value lists that let find() run
+    // without the shard lock, 0 = off
+    size_t snapshotSlots = 0;
+
+    StorageEngine engine = StorageEngine::BTree;
+    // Keys the LSM engine buffers in memory before writing a run
+    size_t memtableKeys = 8192;
+
+    // Open the index with O_DIRECT, so that index pages are cached only by
+    // the pager; ignored where the filesystem does not support it
+    bool directIo = false;
+
+    // Batch the index page reads of a batch window and write the data log
+    // in the background, through an io_uring where available (see
+    // IoScheduler). Per-op durability still writes synchronously.
+    bool asyncIo = false;
+};
+
+// Parses all of text as a number that fits Number, unsigned unless Number is
+// floating point; false if it is empty, malformed or out of range
+template <typename Number>
+bool parseNumber(const std::string& text, Number& number) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    errno = 0;
+    if constexpr (std::is_floating_point_v<Number>) {
+        number = std::strtod(begin, &end);
+    } else {
+        // strtoull would wrap a negative number around
+        if (text.find('-') != std::string::npos) return false;
+        unsigned long long parsed = std::strtoull(begin, &end, 10);
+        if (parsed > std::numeric_limits<Number>::max()) return false;
+        number = static_cast<Number>(parsed);
+    }
+    return end != begin && *end == '\0' && errno == 0;
+}
+
+// Applies one --name=value storage flag; returns false if name and value
+// are not a storage option or the value is not a valid number
+inline bool parseStorageOption(const std::string& name, const std::string& value, StorageOptions& options) {
+    bool ok = true;
+    if (name == "--compact-ratio") {
+        ok = parseNumber(value, options.compactRatio);
+    } else if (name == "--compact-min-bytes") {
+        ok = parseNumber(value, options.compactMinBytes);
+    } else if (name == "--cache-bytes") {
+        ok = parseNumber(value, options.cacheBytes);
+    } else if (name == "--durability" && value == "op") {
+        options.durability = Durability::PerOp;
+    } else if (name == "--durability" && value == "periodic") {
+        options.durability = Durability::Periodic;
+    } else if (name == "--durability" && value == "exit") {
+        options.durability = Durability::OnExit;
+    } else if (name == "--flush-ops") {
+        ok = parseNumber(value, options.flushEveryOps);
+    } else if (name == "--flush-ms") {
+        ok = parseNumber(value, options.flushIntervalMs);
+    } else if (name == "--checkpoint-bytes") {
+        ok = parseNumber(value, options.checkpointBytes);
+    } else if (name == "--recovery-threads") {
+        ok = parseNumber(value, options.recoveryThreads);
+        options.recoveryThreads = std::max(1u, options.recoveryThreads);
+    } else if (name == "--shards") {
+        ok = parseNumber(value, options.shards);
+    } else if (name == "--snapshot-slots") {
+        ok = parseNumber(value, options.snapshotSlots);
+    } else if (name == "--engine" && value == "btree") {
+        options.engine = StorageEngine::BTree;
+    } else if (name == "--engine" && value == "lsm") {
+        options.engine = StorageEngine::Lsm;
+    } else if (name == "--memtable-keys") {
+        ok = parseNumber(value, options.memtableKeys);
+        options.memtableKeys = std::max<size_t>(1, options.memtableKeys);
+    } else if (name == "--async-io") {
+        options.asyncIo = value != "0";
+    } else if (name == "--direct-io") {
+        options.directIo = value != "0";
+    } else {
+        return false;
+    }
+    return ok;
+}
+
+const uint32_t BLOOM_MAGIC = 0x4d4f4c42;  // "BLOM"
+const uint32_t BLOOM_VERSION = 1;
+
+// Blocked Bloom filter over index strings, persisted next to the data
+// file. A key sets PROBES bits inside a single 64-byte block, so a lookup
+// touches one cache line. Deletes leave their bits set; the filter is
+// rebuilt from the tree after compaction and when it outgrows its sizing.
+// A saved filter carries a stamp of the store state it was saved for: the
+// data file size for FileStorage, the next sequence number for LsmStorage.
+class BloomFilter {
+private:
+    static constexpr size_t BLOCK_WORDS = 8;       // 512 bits per block
+    static constexpr size_t BITS_PER_KEY = 10;
+    static constexpr int PROBES = 6;
+    static constexpr uint64_t MIN_KEYS = 16384;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t blockCount;
+        uint64_t keyCapacity;
+        uint64_t keyCount;
+        uint64_t stamp;           // Store state the filter matches
+    };
+
+    std::vector<uint64_t> words;
+    uint64_t blockMask = 0;
+    uint64_t keyCapacity = 0;
+    uint64_t keyCount = 0;        // Keys that set at least one new bit
+
+    static uint64_t hashKey(std::string_view index) {
+        uint64_t hash = fnv1a(index.substr(0, KEY_BYTES));
+        // Finalize so the low and high halves are both well mixed
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Calls probe(word, mask) for each bit of the key
+    template <typename Probe>
+    void forEachBit(std::string_view index, Probe probe) const {
+        uint64_t hash = hashKey(index);
+        uint64_t* block = const_cast<uint64_t*>(words.data()) + (hash & blockMask) * BLOCK_WORDS;
+        uint64_t bits = hash >> 10;
+        for (int i = 0; i < PROBES; i++, bits >>= 9) {
+            uint32_t bit = bits & 511;
+            probe(block[bit / 64], 1ull << (bit % 64));
+        }
+    }
+
+public:
+    // Empty the filter and size it for at least expectedKeys keys
+    void reset(uint64_t expectedKeys) {
+        keyCapacity = std::max(expectedKeys, MIN_KEYS);
+        uint64_t blocks = 1;
+        while (blocks * BLOCK_WORDS * 64 < keyCapacity * BITS_PER_KEY) blocks *= 2;
+        words.assign(blocks * BLOCK_WORDS, 0);
+        blockMask = blocks - 1;
+        keyCount = 0;
+    }
+
+    void add(std::string_view index) {
+        bool changed = false;
+        forEachBit(index, [&](uint64_t& word, uint64_t mask) {
+            changed |= (word & mask) == 0;
+            word |= mask;
+        });
+        if (changed) keyCount++;
+    }
+
+    bool mayContain(std::string_view index) const {
+        bool all = true;
+        forEachBit(index, [&](uint64_t& word, uint64_t mask) {
+            all &= (word & mask) != 0;
+        });
+        return all;
+    }
+
+    // True once more keys were added than the filter was sized for
+    bool overfull() const {
+        return keyCount > keyCapacity;
+    }
+
+    uint64_t keys() const {
+        return keyCount;
+    }
+
+    // Returns false unless the file holds a filter saved with this stamp
+    bool load(const std::string& path, uint64_t stamp) {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        Header header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (header.magic != BLOOM_MAGIC || header.version != BLOOM_VERSION ||
+            header.stamp != stamp || header.blockCount == 0 ||
+            (header.blockCount & (header.blockCount - 1)) != 0) {
+            return false;
+        }
+
+        words.resize(header.blockCount * BLOCK_WORDS);
+        if (!file.read(reinterpret_cast<char*>(words.data()), words.size() * sizeof(uint64_t))) {
+            return false;
+        }
+        blockMask = header.blockCount - 1;
+        keyCapacity = header.keyCapacity;
+        keyCount = header.keyCount;
+        return true;
+    }
+
+    void save(const std::string& path, uint64_t stamp) const {
+        Header header;
+        header.magic = BLOOM_MAGIC;
+        header.version = BLOOM_VERSION;
+        header.blockCount = blockMask + 1;
+        header.keyCapacity = keyCapacity;
+        header.keyCount = keyCount;
+        header.stamp = stamp;
+
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+    }
+};
+
+// Read-only view of the data file through a sliding window. With mmap the
+// window is mapped straight from the file, so records are parsed in place;
+// otherwise it is filled with stream reads. Either way at most one window
+// is resident at a time.
+class DataFileReader {
+private:
+    static constexpr size_t WINDOW_BYTES = 1 << 20;
+    static constexpr size_t MIN_WINDOW_BYTES = 64 << 10;
+
+    uint64_t fileBytes = 0;
+    size_t windowLimit = WINDOW_BYTES;
+    uint64_t windowStart = 0;
+    size_t windowBytes = 0;
+    const char* window = nullptr;
+
+#ifdef FILESTORAGE_HAVE_MMAP
+    int fd = -1;
+    void* mapping = nullptr;
+    size_t mappingBytes = 0;
+#endif
+    std::ifstream stream;
+    std::vector<char> buffer;
+
+    void unmap() {
+#ifdef FILESTORAGE_HAVE_MMAP
+        if (mapping != nullptr) {
+            munmap(mapping, mappingBytes);
+            mapping = nullptr;
+        }
+#endif
+        window = nullptr;
+        windowBytes = 0;
+    }
+
+    // Position the window so that it starts at or just before offset
+    bool load(uint64_t offset) {
+        unmap();
+#ifdef FILESTORAGE_HAVE_MMAP
+        if (fd >= 0) {
+            static const uint64_t pageBytes = sysconf(_SC_PAGESIZE);
+            uint64_t start = offset - offset % pageBytes;
+            size_t length = std::min<uint64_t>(windowLimit, fileBytes - start);
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, start);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, length, MADV_SEQUENTIAL);
+                mapping = mapped;
+                mappingBytes = length;
+                window = static_cast<const char*>(mapped);
+                windowStart = start;
+                windowBytes = length;
+                return true;
+            }
+            // Fall back to stream reads for the rest of this file
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        if (!stream.is_open()) return false;
+        size_t length = std::min<uint64_t>(windowLimit, fileBytes - offset);
+        buffer.resize(windowLimit);
+        stream.clear();
+        stream.seekg(offset, std::ios::beg);
+        stream.read(buffer.data(), length);
+        if (static_cast<size_t>(stream.gcount()) != length) return false;
+        window = buffer.data();
+        windowStart = offset;
+        windowBytes = length;
+        return true;
+    }
+
+public:
+    ~DataFileReader() {
+        close();
+    }
+
+    // maxWindowBytes bounds the part of the file mapped or buffered at once
+    bool open(const std::string& path, size_t maxWindowBytes = WINDOW_BYTES) {
+        close();
+        windowLimit = std::max(maxWindowBytes, MIN_WINDOW_BYTES);
+#ifdef FILESTORAGE_HAVE_MMAP
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                fileBytes = st.st_size;
+                return true;
+            }
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        stream.open(path, std::ios::in | std::ios::binary);
+        if (!stream.is_open()) return false;
+        stream.seekg(0, std::ios::end);
+        fileBytes = stream.tellg();
+        return true;
+    }
+
+    void close() {
+        unmap();
+#ifdef FILESTORAGE_HAVE_MMAP
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        if (stream.is_open()) stream.close();
+        buffer.clear();
+        buffer.shrink_to_fit();
+        fileBytes = 0;
+    }
+
+    uint64_t size() const {
+        return fileBytes;
+    }
+
+    // Returns a pointer to length contiguous bytes at offset, or nullptr if
+    // they extend past the end of the file. Valid until the next call.
+    const char* at(uint64_t offset, size_t length) {
+        if (offset + length > fileBytes) return nullptr;
+        if (window == nullptr || offset < windowStart ||
+            offset + length > windowStart + windowBytes) {
+            if (!load(offset)) return nullptr;
+        }
+        return window + (offset - windowStart);
+    }
+};
+
+// Reflected CRC32C (Castagnoli) table for the portable implementation
+inline const uint32_t* crc32cTable() {
+    static const auto table = [] {
+        std::array<uint32_t, 256> entries;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78u : 0);
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+    return table.data();
+}
+
+inline uint32_t crc32cPortable(const char* data, size_t length, uint32_t crc) {
+    const uint32_t* table = crc32cTable();
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(const char* data, size_t length, uint32_t crc) {
+    uint64_t wide = crc;
+    for (; length >= sizeof(uint64_t); data += sizeof(uint64_t), length -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = static_cast<uint32_t>(wide);
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+    }
+    return crc;
+}
+#endif
+
+// CRC32C of length bytes, using the SSE4.2 instruction when the CPU has it
+inline uint32_t crc32c(const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+#ifdef FILESTORAGE_HAVE_CPU_DISPATCH
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cHardware(bytes, length, ~0u);
+#endif
+    return ~crc32cPortable(bytes, length, ~0u);
+}
+
+const uint32_t DATA_MAGIC = 0x42445346;  // "FSDB"
+// Version 1 is the original headerless log of variable-length
+// [deleted:u8][len:u32][bytes][value:i32] records. Version 2 records had
+// no checksum or sequence number.
+const uint32_t DATA_VERSION = 3;
+
+// First bytes of the data file
+struct DataHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordBytes;
+    uint32_t reserved0;
+    uint64_t generation;      // Bumped each time the file is rewritten
+    uint64_t firstLsn;        // Sequence number of the first record
+    uint32_t reserved[8];
+};
+
+const uint8_t RECORD_INSERT = 0;
+// Logs a delete. Always written with deleted set, so it counts as dead
+// space from the start.
+const uint8_t RECORD_TOMBSTONE = 1;
+
+// Fixed-width data file record. Record i starts at
+// sizeof(DataHeader) + i * sizeof(DataRecord) and has sequence number
+// firstLsn + i. The checksum covers everything before it; the deleted flag
+// is patched in place later, so it sits after the checksum and is only a
+// hint that replay may skip the record.
+struct DataRecord {
+    Key key;
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint64_t lsn;
+    uint32_t crc;
+    uint8_t deleted;
+    uint8_t reserved2[3];
+};
+
+// Version 2 record, read only to migrate old files
+struct DataRecordV2 {
+    Key key;
+    uint8_t deleted;
+    uint8_t kind;
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(DataHeader) == 64, "data header must be 64 bytes");
+static_assert(sizeof(DataRecord) % 8 == 0, "data records must stay 8-byte aligned");
+
+const uint64_t DATA_HEADER_BYTES = sizeof(DataHeader);
+const uint64_t DELETED_FLAG_OFFSET = offsetof(DataRecord, deleted);
+const size_t RECORD_CHECKED_BYTES = offsetof(DataRecord, crc);
+
+// True if record is intact and carries the expected sequence number
+inline bool validRecord(const DataRecord& record, uint64_t lsn) {
+    return record.lsn == lsn && record.crc == crc32c(&record, RECORD_CHECKED_BYTES);
+}
+
+inline void appendDataHeader(std::string& buffer, uint64_t generation, uint64_t firstLsn) {
+    DataHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DATA_MAGIC;
+    header.version = DATA_VERSION;
+    header.recordBytes = sizeof(DataRecord);
+    header.generation = generation;
+    header.firstLsn = firstLsn;
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+inline void appendDataRecord(std::string& buffer, const Key& key, uint8_t kind, bool deleted, uint64_t lsn) {
+    DataRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = key;
+    record.kind = kind;
+    record.lsn = lsn;
+    record.crc = crc32c(&record, RECORD_CHECKED_BYTES);
+    record.deleted = deleted;
+    buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+inline void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Returns false if the varint runs past end or is too long
+inline bool readVarint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Builds a block of ascending keys. Each key is stored as
+//   varint (shared << 1 | flag)  bytes in common with the previous index
+//   varint suffixLen, suffix     the rest of the index
+//   varint value                 delta from the previous value if the index
+//                                repeats, else the zigzagged value
+//   [varint payload]             zigzagged delta from the previous payload
+// so the values of one index cost a byte or two each. The first key of a
+// block is coded in full, which makes every block decodable on its own.
+class KeyBlockWriter {
+private:
+    std::string data;
+    Key previous;
+    size_t previousLen = 0;
+    uint64_t previousPayload = 0;
+    uint32_t entryCount = 0;
+    bool withPayload;
+
+public:
+    explicit KeyBlockWriter(bool payload) : withPayload(payload) {}
+
+    void add(const Key& key, bool flag, uint64_t payload = 0) {
+        size_t len = strnlen(key.index, KEY_BYTES);
+        size_t shared = 0;
+        if (entryCount > 0) {
+            size_t limit = std::min(len, previousLen);
+            while (shared < limit && key.index[shared] == previous.index[shared]) shared++;
+        }
+
+        appendVarint(data, shared << 1 | flag);
+        appendVarint(data, len - shared);
+        data.append(key.index + shared, len - shared);
+        if (entryCount > 0 && shared == len && len == previousLen) {
+            appendVarint(data, static_cast<uint32_t>(key.value) - static_cast<uint32_t>(previous.value));
+        } else {
+            appendVarint(data, zigzag(key.value));
+        }
+        if (withPayload) {
+            appendVarint(data, zigzag(static_cast<int64_t>(payload - previousPayload)));
+            previousPayload = payload;
+        }
+
+        previous = key;
+        previousLen = len;
+        entryCount++;
+    }
+
+    const std::string& bytes() const {
+        return data;
+    }
+
+    uint32_t entries() const {
+        return entryCount;
+    }
+
+    void clear() {
+        data.clear();
+        previousPayload = 0;
+        entryCount = 0;
+    }
+};
+
+// Decodes a block written by KeyBlockWriter in place
+class KeyBlockReader {
+private:
+    const char* pos = nullptr;
+    const char* end = nullptr;
+    Key current;
+    size_t currentLen = 0;
+    uint64_t currentPayload = 0;
+    bool started = false;
+    bool withPayload;
+
+public:
+    explicit KeyBlockReader(bool payload) : withPayload(payload) {}
+
+    void reset(const char* data, size_t bytes) {
+        pos = data;
+        end = data + bytes;
+        memset(&current, 0, sizeof(current));
+        currentLen = 0;
+        currentPayload = 0;
+        started = false;
+    }
+
+    bool done() const {
+        return pos == end;
+    }
+
+    // Decode the next key; returns false on a malformed block
+    bool next(Key& key, bool& flag, uint64_t& payload) {
+        uint64_t head, suffix, value;
+        if (!readVarint(pos, end, head) || !readVarint(pos, end, suffix)) return false;
+        uint64_t shared = head >> 1;
+        if (shared > currentLen || suffix > KEY_BYTES - shared ||
+            suffix > static_cast<uint64_t>(end - pos)) {
+            return false;
+        }
+
+        size_t len = shared + suffix;
+        bool sameIndex = started && suffix == 0 && len == currentLen;
+        memcpy(current.index + shared, pos, suffix);
+        if (len < currentLen) memset(current.index + len, 0, currentLen - len);
+        pos += suffix;
+
+        if (!readVarint(pos, end, value)) return false;
+        current.value = sameIndex ? static_cast<int32_t>(static_cast<uint32_t>(current.value) + static_cast<uint32_t>(value))
+                                  : static_cast<int32_t>(unzigzag(value));
+        if (withPayload) {
+            uint64_t delta;
+            if (!readVarint(pos, end, delta)) return false;
+            currentPayload += unzigzag(delta);
+            payload = currentPayload;
+        }
+
+        currentLen = len;
+        started = true;
+        flag = head & 1;
+        key = current;
+        return true;
+    }
+};
+
+const uint32_t CHECKPOINT_MAGIC = 0x54504b43;  // "CKPT"
+const uint32_t CHECKPOINT_VERSION = 2;
+
+// Target size of a checkpoint block
+const size_t CHECKPOINT_BLOCK_BYTES = 64 << 10;
+
+// First bytes of the checkpoint file, followed by bodyBytes of blocks that
+// hold entryCount index entries in key order
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;      // Data file generation the offsets refer to
+    uint64_t logBytes;        // Every record before this offset is reflected
+    uint64_t deadBytes;
+    uint64_t entryCount;
+    uint64_t bodyBytes;
+};
+
+// Precedes each checkpoint block, a KeyBlockWriter block whose payload is
+// the entry's record number in the data file
+struct CheckpointBlock {
+    uint32_t bytes;
+    uint32_t entries;
+    uint32_t crc;             // CRC32C of the block bytes
+    uint32_t reserved;
+};
+
+// Streams index entries in key order into a new checkpoint file
+class CheckpointWriter {
+private:
+    std::ofstream out;
+    CheckpointHeader header;
+    KeyBlockWriter block{true};
+
+    void writeBlock() {
+        if (block.entries() == 0) return;
+        const std::string& bytes = block.bytes();
+        CheckpointBlock blockHeader{static_cast<uint32_t>(bytes.size()), block.entries(),
+                                    crc32c(bytes.data(), bytes.size()), 0};
+        out.write(reinterpret_cast<const char*>(&blockHeader), sizeof(blockHeader));
+        out.write(bytes.data(), bytes.size());
+        header.bodyBytes += sizeof(blockHeader) + bytes.size();
+        block.clear();
+    }
+
+public:
+    explicit CheckpointWriter(const std::string& path) : out(path, std::ios::out | std::ios::binary | std::ios::trunc) {
+        memset(&header, 0, sizeof(header));
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    void add(const Entry& entry) {
+        block.add(entry.key, false, (entry.offset - DATA_HEADER_BYTES) / sizeof(DataRecord));
+        header.entryCount++;
+        if (block.bytes().size() >= CHECKPOINT_BLOCK_BYTES) writeBlock();
+    }
+
+    // Write the header last; returns false if any write failed
+    bool finish(uint64_t generation, uint64_t logBytes, uint64_t deadBytes) {
+        writeBlock();
+        header.magic = CHECKPOINT_MAGIC;
+        header.version = CHECKPOINT_VERSION;
+        header.generation = generation;
+        header.logBytes = logBytes;
+        header.deadBytes = deadBytes;
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        return static_cast<bool>(out);
+    }
+};
+
+// Size of a version 1 record for an index of indexLen bytes
+inline uint64_t legacyRecordBytes(size_t indexLen) {
+    return sizeof(uint8_t) + sizeof(uint32_t) + indexLen + sizeof(int32_t);
+}
+
+// Longest decimal form of an int, including the sign
+const size_t INT_DIGITS = 11;
+
+// Formats value so that it ends just before end; returns where it starts
+inline char* formatInt(int value, char* end) {
+    char* p = end;
+    // Work in unsigned so INT_MIN does not overflow
+    unsigned int magnitude = value < 0 ? 0u - static_cast<unsigned int>(value) : value;
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) *--p = '-';
+    return p;
+}
+
+// Buffered stdout writer. Output is flushed only when the buffer fills and
+// on destruction, not once per line.
+class OutputWriter {
+private:
+    static constexpr size_t BUFFER_BYTES = 1 << 16;
+
+    char buffer[BUFFER_BYTES];
+    size_t used = 0;
+
+public:
+    ~OutputWriter() {
+        flush();
+    }
+
+    void flush() {
+        if (used > 0) {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+        fflush(stdout);
+    }
+
+    void put(char c) {
+        if (used == BUFFER_BYTES) flush();
+        buffer[used++] = c;
+    }
+
+    void write(const char* data, size_t length) {
+        if (used + length > BUFFER_BYTES) {
+            flush();
+            if (length > BUFFER_BYTES) {
+                fwrite(data, 1, length, stdout);
+                return;
+            }
+        }
+        memcpy(buffer + used, data, length);
+        used += length;
+    }
+
+    void writeInt(int value) {
+        char digits[INT_DIGITS];
+        char* start = formatInt(value, digits + INT_DIGITS);
+        write(start, digits + INT_DIGITS - start);
+    }
+};
+
+// A live record or tombstone seen while replaying the data file
+struct ReplayEvent {
+    Key key;
+    uint32_t kind;
+    uint64_t offset;
+};
+
+inline bool replayOrder(const ReplayEvent& a, const ReplayEvent& b) {
+    int cmp = compareKeys(a.key, b.key);
+    return cmp != 0 ? cmp < 0 : a.offset < b.offset;
+}
+
+// Merges replay slices that are each sorted by (key, offset). Since the
+// slices partition the log, every key's events come out in log order and
+// are resolved to the record that survives them, in key order.
+class ReplayMerge {
+private:
+    const std::vector<std::vector<ReplayEvent>>& slices;
+    std::vector<size_t> positions;
+    const ReplayEvent* pending;
+    uint64_t dead = 0;
+
+    const ReplayEvent* pop() {
+        size_t best = slices.size();
+        for (size_t i = 0; i < slices.size(); i++) {
+            if (positions[i] < slices[i].size() &&
+                (best == slices.size() || replayOrder(slices[i][positions[i]], slices[best][positions[best]]))) {
+                best = i;
+            }
+        }
+        return best == slices.size() ? nullptr : &slices[best][positions[best]++];
+    }
+
+public:
+    explicit ReplayMerge(const std::vector<std::vector<ReplayEvent>>& replaySlices)
+        : slices(replaySlices), positions(replaySlices.size(), 0) {
+        pending = pop();
+    }
+
+    // Returns false once every key has been resolved
+    bool next(Entry& entry) {
+        while (pending != nullptr) {
+            Key key = pending->key;
+            bool present = false;
+            uint64_t offset = 0;
+            // Same rules as a sequential replay: an insert of a present
+            // key is ignored, a tombstone drops it
+            for (; pending != nullptr && compareKeys(pending->key, key) == 0; pending = pop()) {
+                if (pending->kind == RECORD_TOMBSTONE) {
+                    if (present) dead += sizeof(DataRecord);
+                    present = false;
+                    dead += sizeof(DataRecord);
+                } else if (!present) {
+                    present = true;
+                    offset = pending->offset;
+                }
+            }
+            if (present) {
+                entry.key = key;
+                entry.reserved = 0;
+                entry.offset = offset;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Bytes of records the merged events killed
+    uint64_t deadBytes() const {
+        return dead;
+    }
+};
+
+// Paths of the files that make up one store
+struct StorageFiles {
+    std::string data;
+    std::string index;
+    std::string compact;       // Data file being rewritten
+    std::string bloom;
+    std::string checkpoint;
+    std::string checkpointTmp;
+    std::string loadRun;       // Prefix of the sorted runs of a bulk load
+
+    explicit StorageFiles(const std::string& base)
+        : data(base + ".db"), index(base + ".idx"), compact(base + ".db.tmp"),
+          bloom(base + ".bloom"), checkpoint(base + ".ckpt"), checkpointTmp(base + ".ckpt.tmp"),
+          loadRun(base + ".load.") {}
+};
+
+// What a bulk load made of its input file
+struct LoadResult {
+    bool opened = false;
+    uint64_t pairs = 0;           // Lines read as an index and a value
+    uint64_t malformed = 0;       // Other non-blank lines, which are skipped
+    uint64_t firstMalformed = 0;  // Line number of the first of those
+};
+
+// Reads the "index value" lines of a bulk-load file. Lines holding
+// anything else are skipped and counted in the result.
+class PairFileReader {
+private:
+    std::ifstream in;
+    std::string line;
+    uint64_t lineNumber = 0;
+    LoadResult& result;
+
+public:
+    PairFileReader(const std::string& path, LoadResult& loadResult) : in(path), result(loadResult) {
+        result.opened = in.is_open();
+    }
+
+    // index is valid until the next call
+    bool next(std::string_view& index, int& value) {
+        while (std::getline(in, line)) {
+            lineNumber++;
+            const char* pos = line.c_str();
+            const char* end = pos + line.size();
+            auto skipSpace = [&] {
+                while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) pos++;
+            };
+
+            skipSpace();
+            if (pos == end) continue;
+            const char* start = pos;
+            while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r') pos++;
+            index = std::string_view(start, pos - start);
+
+            skipSpace();
+            char* parsedEnd;
+            errno = 0;
+            long parsed = strtol(pos, &parsedEnd, 10);
+            bool valid = parsedEnd != pos && errno == 0 && parsed >= INT_MIN && parsed <= INT_MAX;
+            pos = parsedEnd;
+            skipSpace();
+            if (valid && pos == end) {
+                value = static_cast<int>(parsed);
+                result.pairs++;
+                return true;
+            }
+
+            if (result.malformed++ == 0) result.firstMalformed = lineNumber;
+        }
+        return false;
+    }
+};
+
+// Fewest keys sorted per bulk-load run and read per run while merging,
+// however small the scratch budget
+const size_t MIN_LOAD_RUN_KEYS = 1024;
+const size_t MIN_RUN_BUFFER_KEYS = 32;
+// Most runs a bulk load keeps on disk. Once this many are spilled they are
+// merged into one, which keeps a large load within a small file budget.
+const size_t LOAD_MERGE_RUNS = 8;
+
+// Sequential reader over a file of sorted Keys, one small buffer at a time.
+// The buffer belongs to the caller, so that the readers of a merge can
+// share one allocation.
+class KeyRunReader {
+private:
+    std::ifstream file;
+    Key* buffer;
+    size_t capacity;
+    size_t count = 0;
+    size_t pos = 0;
+
+    void refill() {
+        file.read(reinterpret_cast<char*>(buffer), capacity * sizeof(Key));
+        count = file.gcount() / sizeof(Key);
+        pos = 0;
+    }
+
+public:
+    // The stream is left unbuffered, since buffer already batches its reads
+    KeyRunReader(const std::string& path, Key* keys, size_t keyCount) : buffer(keys), capacity(keyCount) {
+        file.rdbuf()->pubsetbuf(nullptr, 0);
+        file.open(path, std::ios::in | std::ios::binary);
+        requireIo(file.is_open(), path, "open");
+        refill();
+    }
+
+    bool valid() const {
+        return pos < count;
+    }
+
+    const Key& key() const {
+        return buffer[pos];
+    }
+
+    void next() {
+        if (++pos == count) refill();
+    }
+};
+
+// Merges runs of sorted, distinct Keys into one sorted stream; a key held by
+// several runs comes out once. The buffer is split up between the readers.
+class KeyRunMerger {
+private:
+    std::vector<KeyRunReader> runs;
+    size_t best = 0;
+
+    void pick() {
+        best = runs.size();
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (runs[i].valid() && (best == runs.size() || compareKeys(runs[i].key(), runs[best].key()) < 0)) {
+                best = i;
+            }
+        }
+    }
+
+public:
+    KeyRunMerger(const std::vector<std::string>& paths, std::vector<Key>& buffer) {
+        size_t bufferKeys = std::max(MIN_RUN_BUFFER_KEYS, buffer.capacity() / paths.size());
+        buffer.resize(bufferKeys * paths.size());
+        runs.reserve(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            runs.emplace_back(paths[i], &buffer[i * bufferKeys], bufferKeys);
+        }
+        pick();
+    }
+
+    bool valid() const {
+        return best < runs.size();
+    }
+
+    const Key& key() const {
+        return runs[best].key();
+    }
+
+    void next() {
+        Key key = runs[best].key();
+        for (KeyRunReader& run : runs) {
+            if (run.valid() && compareKeys(run.key(), key) == 0) run.next();
+        }
+        pick();
+    }
+};
+
+class FileStorage {
+private:
+    StorageOptions options;
+    StorageFiles files;
+    RandomAccessFile dataFile;
+    BPlusTree tree;
+    BloomFilter bloom;
+    uint64_t dataBytes = 0;     // Logical size, including buffered records
+    uint64_t deadBytes = 0;
+    uint64_t generation = 0;
+    uint64_t checkpointBytes = 0;  // Data file bytes the checkpoint covers, 0 = none
+    uint64_t firstLsn = 1;         // Sequence number of the first record in the file
+    uint64_t nextLsn = 1;
+
+    // Write-behind state: records past writtenBytes live in pendingRecords,
+    // tombstones for records before it wait in pendingTombstones. With
+    // asyncIo, writingRecords is the append still in flight.
+    IoScheduler io;
+    std::string writingRecords;
+    std::string pendingRecords;
+    std::vector<uint64_t> pendingTombstones;
+    uint64_t writtenBytes = 0;
+    uint32_t opsSinceFlush = 0;
+    std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
+
+    // Queue a record for appending to the file
+    void writeEntry(const Key& key, uint8_t kind = RECORD_INSERT) {
+        appendDataRecord(pendingRecords, key, kind, kind == RECORD_TOMBSTONE, nextLsn++);
+        dataBytes += sizeof(DataRecord);
+        if (pendingRecords.size() >= WRITE_BUFFER_BYTES) {
+            flushData(options.asyncIo && options.durability != Durability::PerOp);
+        }
+    }
+
+    // Flag the record at offset as deleted. Records still in the write
+    // buffer are patched in place; others get one positioned write at the
+    // next flush.
+    void markDeleted(uint64_t offset) {
+        if (offset >= writtenBytes) {
+            pendingRecords[offset - writtenBytes + DELETED_FLAG_OFFSET] = 1;
+            return;
+        }
+        pendingTombstones.push_back(offset);
+        if (pendingTombstones.size() >= MAX_PENDING_TOMBSTONES) {
+            flushData();
+        }
+    }
+
+    // Write out buffered records and tombstones in one pass over the file.
+    // With background set the records are appended while the caller moves
+    // on; otherwise every write is done on return.
+    void flushData(bool background = false) {
+        FILESTORAGE_TIME(Timer::LogFlush);
+        FILESTORAGE_COUNT(Stat::LogFlushes, 1);
+        // The previous append, which tombstones may point into, lands first
+        if (!writingRecords.empty()) {
+            requireIo(io.finishWrites(), dataFile, "background append");
+            writingRecords.clear();
+        }
+
+        if (!pendingRecords.empty()) {
+            if (background) {
+                writingRecords.swap(pendingRecords);
+                io.startWrite(dataFile, writtenBytes, writingRecords.data(), writingRecords.size());
+                writtenBytes += writingRecords.size();
+            } else {
+                requireIo(dataFile.write(writtenBytes, pendingRecords.data(), pendingRecords.size()), dataFile, "append");
+                writtenBytes += pendingRecords.size();
+                pendingRecords.clear();
+            }
+        }
+
+        std::sort(pendingTombstones.begin(), pendingTombstones.end());
+        uint8_t del = 1;
+        for (uint64_t offset : pendingTombstones) {
+            requireIo(dataFile.write(offset + DELETED_FLAG_OFFSET, &del, sizeof(del)), dataFile, "tombstone write");
+        }
+        pendingTombstones.clear();
+
+        opsSinceFlush = 0;
+        lastFlush = std::chrono::steady_clock::now();
+    }
+
+    // Apply the durability policy after a write
+    void commitOp() {
+        switch (options.durability) {
+        case Durability::PerOp:
+            flushData();
+            requireIo(dataFile.sync(), dataFile, "fdatasync");
+            break;
+        case Durability::Periodic:
+            if (++opsSinceFlush >= options.flushEveryOps ||
+                std::chrono::steady_clock::now() - lastFlush >= std::chrono::milliseconds(options.flushIntervalMs)) {
+                flushData(options.asyncIo);
+            }
+            break;
+        case Durability::OnExit:
+            break;
+        }
+
+        if (options.checkpointBytes > 0 &&
+            dataBytes - std::max(checkpointBytes, DATA_HEADER_BYTES) >= options.checkpointBytes) {
+            writeCheckpoint();
+        }
+    }
+
+    void openDataFile(bool truncate) {
+        requireIo(dataFile.open(files.data, truncate ? FileMode::Truncate : FileMode::ReadWrite), files.data, "open");
+    }
+
+    // Checks the header of a non-empty data file and returns its format
+    // version; version 1 files have no header
+    uint32_t readHeader() {
+        DataHeader header;
+        memset(&header, 0, sizeof(header));
+        dataFile.read(0, &header, std::min<uint64_t>(sizeof(header), dataBytes));
+        if (dataBytes < sizeof(uint32_t) || header.magic != DATA_MAGIC) {
+            return 1;
+        }
+        bool supported = (header.version == DATA_VERSION && header.recordBytes == sizeof(DataRecord)) ||
+                         (header.version == 2 && header.recordBytes == sizeof(DataRecordV2));
+        if (!supported) {
+            std::cerr << files.data << ": unsupported format version " << header.version << std::endl;
+            exit(1);
+        }
+        generation = header.generation;
+        firstLsn = header.version == DATA_VERSION ? header.firstLsn : 1;
+        return header.version;
+    }
+
+    // Drop the log from offset on, where recovery found a torn or corrupt
+    // record; nothing after it can be trusted
+    void truncateLog(uint64_t offset) {
+        dataFile.truncate(offset);
+        dataBytes = offset;
+        writtenBytes = offset;
+        nextLsn = firstLsn + (offset - DATA_HEADER_BYTES) / sizeof(DataRecord);
+    }
+
+    // Reads the checkpoint header and returns true if it matches the data
+    // file as it is now
+    bool readCheckpointHeader(CheckpointHeader& header) {
+        std::ifstream file(files.checkpoint, std::ios::in | std::ios::binary);
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        file.seekg(0, std::ios::end);
+        uint64_t fileBytes = file.tellg();
+        return header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION &&
+               header.generation == generation &&
+               header.logBytes >= DATA_HEADER_BYTES && header.logBytes <= dataBytes &&
+               (header.logBytes - DATA_HEADER_BYTES) % sizeof(DataRecord) == 0 &&
+               fileBytes == sizeof(header) + header.bodyBytes;
+    }
+
+    // Dump the index in key order to a new checkpoint file and rename it
+    // over the old one
+    void writeCheckpoint() {
+        flushData();
+
+        CheckpointWriter out(files.checkpointTmp);
+        Key from;
+        memset(&from, 0, sizeof(from));
+        from.value = INT_MIN;
+        tree.scan(from, [&](const Entry& entry) {
+            out.add(entry);
+            return true;
+        });
+
+        if (out.finish(generation, dataBytes, deadBytes)) {
+            rename(files.checkpointTmp.c_str(), files.checkpoint.c_str());
+            checkpointBytes = dataBytes;
+        }
+    }
+
+    // Bulk-load the tree from the checkpoint, then replay the records
+    // appended after it. Returns false if there is no usable checkpoint.
+    bool recoverFromCheckpoint() {
+        CheckpointHeader header;
+        if (!readCheckpointHeader(header)) return false;
+
+        // Blocks are decoded one at a time, so a window of two is plenty
+        DataFileReader reader;
+        if (!reader.open(files.checkpoint, 2 * CHECKPOINT_BLOCK_BYTES)) return false;
+
+        // Check every block before the tree is touched
+        uint64_t entries = 0;
+        for (uint64_t offset = sizeof(header); offset < reader.size();) {
+            CheckpointBlock block;
+            const char* bytes = reader.at(offset, sizeof(block));
+            if (bytes == nullptr) return false;
+            memcpy(&block, bytes, sizeof(block));
+            bytes = reader.at(offset + sizeof(block), block.bytes);
+            if (bytes == nullptr || crc32c(bytes, block.bytes) != block.crc) return false;
+            entries += block.entries;
+            offset += sizeof(block) + block.bytes;
+        }
+        if (entries != header.entryCount) return false;
+
+        uint64_t offset = sizeof(header);
+        uint32_t blockLeft = 0;
+        KeyBlockReader block(true);
+        tree.bulkLoad(header.entryCount, [&](Entry& entry) {
+            if (blockLeft == 0) {
+                CheckpointBlock blockHeader;
+                memcpy(&blockHeader, reader.at(offset, sizeof(blockHeader)), sizeof(blockHeader));
+                block.reset(reader.at(offset + sizeof(blockHeader), blockHeader.bytes), blockHeader.bytes);
+                offset += sizeof(blockHeader) + blockHeader.bytes;
+                blockLeft = blockHeader.entries;
+            }
+            bool flag;
+            uint64_t record = 0;
+            block.next(entry.key, flag, record);
+            entry.reserved = 0;
+            entry.offset = DATA_HEADER_BYTES + record * sizeof(DataRecord);
+            blockLeft--;
+        });
+        reader.close();
+
+        deadBytes = header.deadBytes;
+        replayLog(header.logBytes);
+        return true;
+    }
+
+    // Full replay into an empty tree. Each thread parses one slice of the
+    // log and sorts its events; the slices are then merged and resolved
+    // twice, once to count the survivors and once to bulk-load them.
+    void replayLogParallel(unsigned threads) {
+        flushData();
+
+        // Records are fixed width, so slice boundaries fall on record
+        // boundaries without scanning
+        uint64_t records = (dataBytes - DATA_HEADER_BYTES) / sizeof(DataRecord);
+        std::vector<std::vector<ReplayEvent>> slices(threads);
+        std::vector<uint64_t> flaggedBytes(threads, 0);
+        std::vector<uint64_t> badRecord(threads, records);   // First invalid record of each slice
+        std::atomic<bool> openFailed{false};
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([&, i] {
+                DataFileReader reader;
+                if (!reader.open(files.data, options.scratchBytes() / threads)) {
+                    openFailed = true;
+                    return;
+                }
+                std::vector<ReplayEvent>& events = slices[i];
+                for (uint64_t n = records * i / threads; n < records * (i + 1) / threads; n++) {
+                    uint64_t offset = DATA_HEADER_BYTES + n * sizeof(DataRecord);
+                    const char* bytes = reader.at(offset, sizeof(DataRecord));
+                    const DataRecord* record = reinterpret_cast<const DataRecord*>(bytes);
+                    if (bytes == nullptr || !validRecord(*record, firstLsn + n)) {
+                        badRecord[i] = n;
+                        break;
+                    }
+
+                    if (record->kind == RECORD_TOMBSTONE || !record->deleted) {
+                        events.push_back(ReplayEvent{record->key, record->kind, offset});
+                    } else {
+                        flaggedBytes[i] += sizeof(DataRecord);
+                    }
+                }
+                std::sort(events.begin(), events.end(), replayOrder);
+            });
+        }
+        for (std::thread& worker : workers) worker.join();
+        // A slice that was never read says nothing about its records, so
+        // the whole log is replayed in one pass instead
+        if (openFailed) {
+            replayLog(DATA_HEADER_BYTES);
+            return;
+        }
+
+        // Everything after the first invalid record is discarded
+        for (unsigned i = 0; i < threads; i++) {
+            if (badRecord[i] < records) {
+                for (unsigned later = i + 1; later < threads; later++) {
+                    slices[later].clear();
+                    flaggedBytes[later] = 0;
+                }
+                truncateLog(DATA_HEADER_BYTES + badRecord[i] * sizeof(DataRecord));
+                break;
+            }
+        }
+        if (dataBytes > DATA_HEADER_BYTES + records * sizeof(DataRecord)) {
+            truncateLog(DATA_HEADER_BYTES + records * sizeof(DataRecord));  // Partial tail
+        }
+
+        for (uint64_t bytes : flaggedBytes) deadBytes += bytes;
+
+        Entry entry;
+        uint64_t survivors = 0;
+        ReplayMerge counting(slices);
+        while (counting.next(entry)) survivors++;
+        deadBytes += counting.deadBytes();
+
+        ReplayMerge merge(slices);
+        tree.bulkLoad(survivors, [&](Entry& next) {
+            merge.next(next);
+        });
+    }
+
+    // Apply the data file records from offset on to the tree. The log ends
+    // at the first torn or corrupt record and is truncated there.
+    void replayLog(uint64_t offset) {
+        flushData();
+
+        DataFileReader reader;
+        requireIo(reader.open(files.data, options.scratchBytes()), files.data, "open");
+
+        // Records are fixed width and 8-byte aligned, so they are read in
+        // place
+        uint64_t lsn = firstLsn + (offset - DATA_HEADER_BYTES) / sizeof(DataRecord);
+        for (;; offset += sizeof(DataRecord), lsn++) {
+            const char* bytes = reader.at(offset, sizeof(DataRecord));
+            const DataRecord* record = reinterpret_cast<const DataRecord*>(bytes);
+            if (bytes == nullptr || !validRecord(*record, lsn)) break;
+
+            if (record->kind == RECORD_TOMBSTONE) {
+                // The record it deletes may have lost its flag in a crash
+                uint64_t erased;
+                if (tree.erase(record->key, erased)) {
+                    deadBytes += sizeof(DataRecord);
+                }
+                deadBytes += sizeof(DataRecord);
+            } else if (!record->deleted) {
+                tree.insert(record->key, offset);
+            } else {
+                deadBytes += sizeof(DataRecord);
+            }
+        }
+
+        reader.close();
+        if (offset < dataBytes) truncateLog(offset);
+    }
+
+    // Writes a header plus the records passed to emit(key[, kind, deleted])
+    // by fill(emit) into a new file and renames it over the data file. emit
+    // returns the record's offset in the new file. Sequence numbers carry
+    // on from the old file.
+    template <typename Fill>
+    void replaceDataFile(Fill fill) {
+        std::ofstream out(files.compact, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::string buffer;
+        appendDataHeader(buffer, generation + 1, nextLsn);
+        firstLsn = nextLsn;
+        uint64_t offset = DATA_HEADER_BYTES;
+
+        fill([&](const Key& key, uint8_t kind = RECORD_INSERT, bool deleted = false) {
+            appendDataRecord(buffer, key, kind, deleted, nextLsn++);
+            if (buffer.size() >= WRITE_BUFFER_BYTES) {
+                requireIo(bool(out.write(buffer.data(), buffer.size())), files.compact, "write");
+                buffer.clear();
+            }
+            uint64_t recordOffset = offset;
+            offset += sizeof(DataRecord);
+            return recordOffset;
+        });
+        requireIo(bool(out.write(buffer.data(), buffer.size())), files.compact, "write");
+        out.close();
+        requireIo(!out.fail(), files.compact, "close");
+
+        // Until the rename the old file stays in place
+        dataFile.close();
+        replaceFile(files.compact, files.data);
+        openDataFile(false);
+
+        dataBytes = offset;
+        writtenBytes = offset;
+        deadBytes = 0;
+        generation++;
+
+        // Offsets in the old checkpoint no longer mean anything
+        ::remove(files.checkpoint.c_str());
+        checkpointBytes = 0;
+    }
+
+    // Convert a version 1 data file, keeping only its live records
+    void migrateLegacyDataFile() {
+        DataFileReader reader;
+        reader.open(files.data, options.scratchBytes());
+
+        replaceDataFile([&](auto emit) {
+            const size_t headerBytes = sizeof(uint8_t) + sizeof(uint32_t);
+            uint64_t offset = 0;
+            while (const char* header = reader.at(offset, headerBytes)) {
+                uint8_t deleted = header[0];
+                uint32_t indexLen;
+                memcpy(&indexLen, header + sizeof(uint8_t), sizeof(indexLen));
+                if (indexLen > 256) break; // Invalid entry
+
+                const char* record = reader.at(offset, legacyRecordBytes(indexLen));
+                if (record == nullptr) break;  // Truncated tail
+
+                if (!deleted) {
+                    int value;
+                    memcpy(&value, record + headerBytes + indexLen, sizeof(value));
+                    emit(makeKey(record + headerBytes, indexLen, value));
+                }
+                offset += legacyRecordBytes(indexLen);
+            }
+        });
+    }
+
+    // Convert a version 2 data file record for record, so that the usual
+    // replay rules apply to it afterwards
+    void migrateV2DataFile() {
+        DataFileReader reader;
+        reader.open(files.data, options.scratchBytes());
+
+        replaceDataFile([&](auto emit) {
+            for (uint64_t offset = DATA_HEADER_BYTES;; offset += sizeof(DataRecordV2)) {
+                const char* bytes = reader.at(offset, sizeof(DataRecordV2));
+                if (bytes == nullptr) break;
+                DataRecordV2 record;
+                memcpy(&record, bytes, sizeof(record));
+                emit(record.key, record.kind, record.deleted != 0);
+            }
+        });
+    }
+
+    bool needsCompaction() const {
+        return deadBytes >= options.compactMinBytes &&
+               deadBytes > options.compactRatio * dataBytes;
+    }
+
+public:
+    // Whether a store of this engine lives under name
+    static bool hasFiles(const std::string& name) {
+        return std::filesystem::exists(StorageFiles(name).data);
+    }
+
+    static void removeFiles(const std::string& name) {
+        StorageFiles files(name);
+        for (const std::string& path : {files.data, files.index, files.compact, files.bloom, files.checkpoint,
+                                   files.checkpointTmp}) {
+            ::remove(path.c_str());
+        }
+    }
+
+    explicit FileStorage(const StorageOptions& storageOptions = StorageOptions(),
+                         const std::string& name = DEFAULT_STORE)
+        : options(storageOptions), files(name) {
+        // Check if file exists
+        std::ifstream testFile(files.data);
+        bool fileExists = testFile.good();
+        testFile.close();
+
+        openDataFile(!fileExists);
+
+        if (fileExists) {
+            dataBytes = dataFile.size();
+        }
+
+        writtenBytes = dataBytes;
+
+        bool migrated = false;
+        if (dataBytes == 0) {
+            appendDataHeader(pendingRecords, generation, firstLsn);
+            dataBytes = DATA_HEADER_BYTES;
+        } else {
+            uint32_t version = readHeader();
+            if (version == 1) {
+                migrateLegacyDataFile();
+            } else if (version == 2) {
+                migrateV2DataFile();
+            }
+            migrated = version != DATA_VERSION;
+        }
+        nextLsn = firstLsn + (dataBytes - DATA_HEADER_BYTES) / sizeof(DataRecord);
+
+        CheckpointHeader checkpoint;
+        if (readCheckpointHeader(checkpoint)) {
+            checkpointBytes = checkpoint.logBytes;
+        }
+
+        // Reuse the on-disk index if it matches the data file, else start
+        // from the checkpoint and fall back to a full replay
+        if (tree.open(files.index, dataBytes, options.cacheBytes, options.directIo) && !migrated) {
+            deadBytes = tree.deadBytes();
+            if (!bloom.load(files.bloom, dataBytes)) {
+                rebuildBloom();
+            }
+        } else if (recoverFromCheckpoint()) {
+            rebuildBloom();
+        } else {
+            rebuildIndex();
+        }
+
+        if (needsCompaction()) {
+            compact();
+        }
+    }
+
+    ~FileStorage() {
+        flushData();
+        dataFile.close();
+        tree.close(dataBytes, deadBytes);
+        bloom.save(files.bloom, dataBytes);
+    }
+
+    // Refill the Bloom filter with every index in the tree
+    void rebuildBloom() {
+        bloom.reset(2 * std::max(tree.entryCount(), bloom.keys()));
+        Key from;
+        memset(&from, 0, sizeof(from));
+        from.value = INT_MIN;
+
+        Key previous = from;
+        tree.scan(from, [&](const Entry& entry) {
+            if (!sameIndex(entry.key, previous)) {
+                bloom.add(std::string_view(entry.key.index, strnlen(entry.key.index, KEY_BYTES)));
+                previous = entry.key;
+            }
+            return true;
+        });
+    }
+
+    // Rewrite the live records into a fresh data file and swap it in. The
+    // index stays dirty until close, so a crash at any point rebuilds from
+    // whichever complete data file is in place.
+    void compact() {
+        flushData();
+        replaceDataFile([&](auto emit) {
+            tree.rewriteOffsets([&](const Entry& entry) {
+                return emit(entry.key);
+            });
+        });
+        // Drop the bits of deleted indexes
+        rebuildBloom();
+    }
+
+    // Rebuild the index from the data file (after a crash or when the index
+    // file is missing)
+    void rebuildIndex() {
+        tree.reset();
+        deadBytes = 0;
+        if (options.recoveryThreads > 1) {
+            replayLogParallel(options.recoveryThreads);
+        } else {
+            replayLog(DATA_HEADER_BYTES);
+        }
+        rebuildBloom();
+    }
+
+    // Insert entry
+    void insert(std::string_view index, int value) {
+        // The tree rejects (index, value) pairs that already exist. The new
+        // record goes at the current end of the data file.
+        Key key = makeKey(index, value);
+        if (tree.insert(key, dataBytes)) {
+            writeEntry(key);
+            commitOp();
+
+            bloom.add(index);
+            if (bloom.overfull()) {
+                rebuildBloom();
+            }
+        }
+    }
+
+    // Delete entry
+    void remove(std::string_view index, int value) {
+        uint64_t offset;
+        if (!bloom.mayContain(index) || !tree.erase(makeKey(index, value), offset)) {
+            return; // Entry doesn't exist
+        }
+
+        // The tombstone record makes the delete durable; the in-place flag
+        // only lets replay skip the dead record
+        markDeleted(offset);
+        writeEntry(makeKey(index, value), RECORD_TOMBSTONE);
+        deadBytes += 2 * sizeof(DataRecord);
+        commitOp();
+
+        if (needsCompaction()) {
+            compact();
+        }
+    }
+
+    // Calls visit(value) for every value of an index in ascending order.
+    // Indexes the Bloom filter rules out cost no page reads.
+    template <typename Visitor>
+    void forEachValue(std::string_view index, Visitor visit) {
+        forEachValueFrom(index, INT_MIN, [&](int value) {
+            visit(value);
+            return true;
+        });
+    }
+
+    // Calls visit(value) for the values >= first of an index in ascending
+    // order until it returns false. The scan starts in first's leaf, so a
+    // page of values costs the same however many values the index has.
+    template <typename Visitor>
+    void forEachValueFrom(std::string_view index, int first, Visitor visit) {
+        if (!bloom.mayContain(index)) return;
+
+        // Keys are ordered by (index, value), so the values come out sorted
+        Key from = makeKey(index, first);
+        tree.scan(from, [&](const Entry& entry) {
+            if (!sameIndex(entry.key, from)) return false;
+            FILESTORAGE_COUNT(Stat::RecordsScanned, 1);
+            return visit(entry.key.value);
+        });
+    }
+
+    // Number of values of an index, from two rank descents of the tree
+    uint64_t countValues(std::string_view index) {
+        if (!bloom.mayContain(index)) return 0;
+        return tree.rank(makeKey(index, INT_MAX), true) - tree.rank(makeKey(index, INT_MIN), false);
+    }
+
+    bool contains(std::string_view index, int value) {
+        return bloom.mayContain(index) && tree.contains(makeKey(index, value));
+    }
+
+    using Cursor = BPlusTree::Cursor;
+
+    // With asyncIo, read the index pages that lookups of keys will need,
+    // batched and overlapped
+    void prefetch(const std::vector<Key>& keys) {
+        if (options.asyncIo) tree.prefetch(keys, io);
+    }
+
+    // Cursor at the first key >= from
+    BPlusTree::Cursor seek(const Key& from) {
+        return tree.seek(from);
+    }
+
+    // Add the pairs of a text file of "index value" lines. The input is
+    // sorted and deduplicated in runs that fill the scratch budget, the runs
+    // are merged with the tree's entries, and the new keys are appended to
+    // the log in key order. The merged entries form a fresh checkpoint that
+    // the tree is then bulk-loaded from.
+    LoadResult load(const std::string& path) {
+        LoadResult result;
+        size_t runKeys = std::max(MIN_LOAD_RUN_KEYS, options.scratchBytes() / sizeof(Key));
+        std::vector<std::string> runPaths;
+        size_t runCount = 0;
+        std::vector<Key> run;
+        run.reserve(runKeys);
+        auto writeRun = [&](auto fill) {
+            runPaths.push_back(files.loadRun + std::to_string(runCount++));
+            std::ofstream out(runPaths.back(), std::ios::out | std::ios::binary | std::ios::trunc);
+            fill([&](const Key* keys, size_t count) {
+                requireIo(bool(out.write(reinterpret_cast<const char*>(keys), count * sizeof(Key))),
+                          runPaths.back(), "write");
+            });
+            out.close();
+            requireIo(!out.fail(), runPaths.back(), "close");
+        };
+        {
+            PairFileReader in(path, result);
+            auto spill = [&] {
+                auto less = [](const Key& a, const Key& b) { return compareKeys(a, b) < 0; };
+                auto equal = [](const Key& a, const Key& b) { return compareKeys(a, b) == 0; };
+                std::sort(run.begin(), run.end(), less);
+                run.erase(std::unique(run.begin(), run.end(), equal), run.end());
+                writeRun([&](auto write) {
+                    write(run.data(), run.size());
+                });
+                run.clear();
+                if (runPaths.size() < LOAD_MERGE_RUNS) return;
+
+                // Merge the runs into one, with the emptied run as buffer
+                std::vector<std::string> inputs;
+                inputs.swap(runPaths);
+                {
+                    KeyRunMerger merger(inputs, run);
+                    writeRun([&](auto write) {
+                        for (; merger.valid(); merger.next()) write(&merger.key(), 1);
+                    });
+                }
+                run.clear();
+                for (const std::string& input : inputs) ::remove(input.c_str());
+            };
+
+            std::string_view index;
+            int value;
+            while (in.next(index, value)) {
+                run.push_back(makeKey(index, value));
+                if (run.size() == runKeys) spill();
+            }
+            if (!run.empty()) spill();
+        }
+        if (runPaths.empty()) return result;
+
+        CheckpointWriter out(files.checkpointTmp);
+        {
+            KeyRunMerger merger(runPaths, run);
+            Key from;
+            memset(&from, 0, sizeof(from));
+            from.value = INT_MIN;
+            BPlusTree::Cursor cursor = tree.seek(from);
+            while (true) {
+                if (cursor.valid() && (!merger.valid() || compareKeys(cursor.entry().key, merger.key()) <= 0)) {
+                    // Present already; its record stays where it is
+                    Entry entry = cursor.entry();
+                    out.add(entry);
+                    if (merger.valid() && compareKeys(merger.key(), entry.key) == 0) merger.next();
+                    cursor.next();
+                    continue;
+                }
+                if (!merger.valid()) break;
+
+                Entry entry;
+                entry.key = merger.key();
+                entry.reserved = 0;
+                entry.offset = dataBytes;
+                writeEntry(entry.key);
+                bloom.add(std::string_view(entry.key.index, strnlen(entry.key.index, KEY_BYTES)));
+                out.add(entry);
+                merger.next();
+            }
+        }
+        run = std::vector<Key>();
+        for (const std::string& runPath : runPaths) ::remove(runPath.c_str());
+
+        // The log holds the new records from here on, so if the checkpoint
+        // can't be written and read back the index is rebuilt from the log
+        flushData();
+        bool checkpointed = out.finish(generation, dataBytes, deadBytes) && syncPath(files.checkpointTmp) &&
+                            std::rename(files.checkpointTmp.c_str(), files.checkpoint.c_str()) == 0 &&
+                            recoverFromCheckpoint();
+        if (!checkpointed) {
+            std::cerr << files.checkpoint << ": load checkpoint failed, rebuilding the index" << std::endl;
+            ::remove(files.checkpointTmp.c_str());
+            ::remove(files.checkpoint.c_str());
+            rebuildIndex();
+            checkpointBytes = 0;
+            return result;
+        }
+        checkpointBytes = dataBytes;
+        if (options.checkpointBytes == 0) {
+            ::remove(files.checkpoint.c_str());
+            checkpointBytes = 0;
+        }
+        if (bloom.overfull()) rebuildBloom();
+        return result;
+    }
+};
+
+const uint32_t RUN_MAGIC = 0x4e555253;  // "SRUN"
+const uint32_t RUN_VERSION = 2;
+const uint32_t MANIFEST_MAGIC = 0x464e414d;  // "MANF"
+const uint32_t MANIFEST_VERSION = 1;
+
+// Level 0 runs that may pile up before they are merged into level 1
+const size_t LSM_LEVEL0_RUNS = 4;
+// Each level holds up to this many times the keys of the one above it
+const uint64_t LSM_LEVEL_RATIO = 10;
+
+struct KeyLess {
+    bool operator()(const Key& a, const Key& b) const {
+        return compareKeys(a, b) < 0;
+    }
+};
+
+// Memtable or sorted run entry; a tombstone hides older versions of a key
+struct RunEntry {
+    Key key;
+    uint32_t tombstone;
+};
+
+// A run block is a KeyBlockWriter block of about PAGE_SIZE bytes whose
+// flag is the tombstone bit. The entry limit bounds a decoded block.
+const uint32_t RUN_BLOCK_ENTRIES = 512;
+// Version 1 blocks were this many raw RunEntry structs
+const uint64_t RUN_V1_BLOCK_ENTRIES = PAGE_SIZE / sizeof(RunEntry);
+
+// Sparse index entry of a run, one per block
+struct RunBlockRef {
+    Key firstKey;
+    uint32_t bytes;
+    uint64_t offset;
+};
+
+// First bytes of a run file, followed by the blocks in key order and then
+// blockCount RunBlockRefs. Version 1 had entryCount raw entries and
+// blockCount first keys instead.
+struct RunHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entryCount;
+    uint64_t blockCount;
+    Key lastKey;
+    uint32_t reserved;
+};
+
+// First bytes of the manifest, followed by runCount ManifestRuns: level 0
+// newest first, then the deeper levels in order
+struct ManifestHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nextRunId;
+    uint64_t runCount;
+};
+
+struct ManifestRun {
+    uint32_t level;
+    uint32_t reserved;
+    uint64_t id;
+};
+
+// Immutable sorted run file. Only the sparse index is held in memory;
+// entries are read a block at a time.
+class SortedRun {
+private:
+    RandomAccessFile file;
+    RunHeader header;
+    std::vector<RunBlockRef> blockRefs;
+    std::string blockBytes;
+
+public:
+    uint64_t id = 0;
+    std::string path;
+
+    bool open(const std::string& runPath, uint64_t runId) {
+        path = runPath;
+        id = runId;
+        if (!file.open(path, FileMode::ReadOnly) || !file.read(0, &header, sizeof(header)) ||
+            header.magic != RUN_MAGIC || (header.version != 1 && header.version != RUN_VERSION)) {
+            return false;
+        }
+
+        blockRefs.resize(header.blockCount);
+        if (header.version == RUN_VERSION) {
+            uint64_t fileBytes = file.size();
+            uint64_t indexBytes = blockRefs.size() * sizeof(RunBlockRef);
+            return fileBytes >= sizeof(header) + indexBytes &&
+                   file.read(fileBytes - indexBytes, blockRefs.data(), indexBytes);
+        }
+
+        uint64_t firstKeys = sizeof(header) + header.entryCount * sizeof(RunEntry);
+        for (uint64_t i = 0; i < header.blockCount; i++) {
+            RunBlockRef& ref = blockRefs[i];
+            if (!file.read(firstKeys + i * sizeof(Key), &ref.firstKey, sizeof(Key))) return false;
+            ref.offset = sizeof(header) + i * RUN_V1_BLOCK_ENTRIES * sizeof(RunEntry);
+            ref.bytes = std::min(RUN_V1_BLOCK_ENTRIES, header.entryCount - i * RUN_V1_BLOCK_ENTRIES) * sizeof(RunEntry);
+        }
+        return true;
+    }
+
+    uint64_t entries() const {
+        return header.entryCount;
+    }
+
+    uint64_t blocks() const {
+        return header.blockCount;
+    }
+
+    // True if the run may hold keys with index in [first, last]
+    bool overlaps(const Key& first, const Key& last) const {
+        return header.entryCount > 0 &&
+               memcmp(blockRefs[0].firstKey.index, last.index, KEY_BYTES) <= 0 &&
+               memcmp(header.lastKey.index, first.index, KEY_BYTES) >= 0;
+    }
+
+    // The block that holds key, or would hold it
+    uint64_t blockFor(const Key& key) const {
+        auto pos = std::upper_bound(blockRefs.begin(), blockRefs.end(), key, [](const Key& key, const RunBlockRef& ref) {
+            return compareKeys(key, ref.firstKey) < 0;
+        });
+        return pos == blockRefs.begin() ? 0 : pos - blockRefs.begin() - 1;
+    }
+
+    // Read and decode one block; a damaged block yields the entries before
+    // the damage
+    void readBlock(uint64_t block, std::vector<RunEntry>& entries) {
+        FILESTORAGE_COUNT(Stat::BlockReads, 1);
+        const RunBlockRef& ref = blockRefs[block];
+        entries.clear();
+        if (header.version == 1) {
+            entries.resize(ref.bytes / sizeof(RunEntry));
+            if (!file.read(ref.offset, entries.data(), entries.size() * sizeof(RunEntry))) entries.clear();
+            return;
+        }
+
+        blockBytes.resize(ref.bytes);
+        if (!file.read(ref.offset, &blockBytes[0], blockBytes.size())) return;
+        KeyBlockReader reader(false);
+        reader.reset(blockBytes.data(), blockBytes.size());
+        RunEntry entry;
+        bool tombstone;
+        uint64_t payload;
+        while (!reader.done() && reader.next(entry.key, tombstone, payload)) {
+            entry.tombstone = tombstone;
+            entries.push_back(entry);
+        }
+    }
+};
+
+// Streams entries in key order into a new run file
+class RunWriter {
+private:
+    std::string path;
+    std::ofstream out;
+    RunHeader header;
+    KeyBlockWriter block{false};
+    std::vector<RunBlockRef> blockRefs;
+    uint64_t offset = sizeof(RunHeader);
+
+    void writeBlock() {
+        if (block.entries() == 0) return;
+        const std::string& bytes = block.bytes();
+        requireIo(bool(out.write(bytes.data(), bytes.size())), path, "write");
+        blockRefs.back().bytes = bytes.size();
+        offset += bytes.size();
+        block.clear();
+    }
+
+public:
+    explicit RunWriter(const std::string& runPath)
+        : path(runPath), out(runPath, std::ios::out | std::ios::binary | std::ios::trunc) {
+        memset(&header, 0, sizeof(header));
+        requireIo(bool(out.write(reinterpret_cast<const char*>(&header), sizeof(header))), path, "write");
+    }
+
+    void add(const Key& key, bool tombstone) {
+        if (block.entries() == 0) blockRefs.push_back(RunBlockRef{key, 0, offset});
+        block.add(key, tombstone);
+        header.entryCount++;
+        header.lastKey = key;
+        if (block.entries() == RUN_BLOCK_ENTRIES || block.bytes().size() >= PAGE_SIZE) writeBlock();
+    }
+
+    void finish() {
+        writeBlock();
+        requireIo(bool(out.write(reinterpret_cast<const char*>(blockRefs.data()), blockRefs.size() * sizeof(RunBlockRef))),
+                  path, "write");
+        header.magic = RUN_MAGIC;
+        header.version = RUN_VERSION;
+        header.blockCount = blockRefs.size();
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        // The run must reach the device before the manifest names it
+        requireIo(!out.fail(), path, "write");
+        requireIo(syncPath(path), path, "fsync");
+    }
+};
+
+// Position in a sorted run, holding one block of it
+class RunCursor {
+private:
+    SortedRun* run;
+    uint64_t block;
+    std::vector<RunEntry> entries;
+    size_t pos = 0;
+
+public:
+    RunCursor(SortedRun& sortedRun, const Key& from) : run(&sortedRun), block(sortedRun.blockFor(from)) {
+        if (block >= run->blocks()) return;
+        run->readBlock(block, entries);
+        pos = std::lower_bound(entries.begin(), entries.end(), from, [](const RunEntry& entry, const Key& key) {
+            return compareKeys(entry.key, key) < 0;
+        }) - entries.begin();
+        if (pos == entries.size()) {
+            pos--;
+            next();
+        }
+    }
+
+    bool valid() const {
+        return pos < entries.size();
+    }
+
+    const RunEntry& entry() const {
+        return entries[pos];
+    }
+
+    void next() {
+        if (++pos < entries.size()) return;
+        if (block + 1 < run->blocks()) {
+            run->readBlock(++block, entries);
+            pos = 0;
+        }
+    }
+};
+
+using Memtable = std::map<Key, bool, KeyLess>;  // Key -> tombstone
+
+// Merges the memtable and sorted runs, given newest first, into one key
+// ordered stream in which only the newest version of each key appears.
+// Tombstones are dropped unless keepTombstones is set. Like the tree
+// cursor, it is only valid while the engine is left unmodified.
+class MergeCursor {
+private:
+    Memtable::const_iterator mem;
+    Memtable::const_iterator memEnd;
+    std::vector<RunCursor> runs;
+    bool keepTombstones;
+    Entry current;
+    bool currentTombstone = false;
+    bool hasCurrent = false;
+
+    void advance() {
+        while (true) {
+            // Of equal keys the first source found, the newest, wins
+            const Key* best = nullptr;
+            bool tombstone = false;
+            if (mem != memEnd) {
+                best = &mem->first;
+                tombstone = mem->second;
+            }
+            for (RunCursor& run : runs) {
+                if (run.valid() && (best == nullptr || compareKeys(run.entry().key, *best) < 0)) {
+                    best = &run.entry().key;
+                    tombstone = run.entry().tombstone;
+                }
+            }
+            if (best == nullptr) {
+                hasCurrent = false;
+                return;
+            }
+
+            current.key = *best;
+            currentTombstone = tombstone;
+            if (mem != memEnd && compareKeys(mem->first, current.key) == 0) ++mem;
+            for (RunCursor& run : runs) {
+                if (run.valid() && compareKeys(run.entry().key, current.key) == 0) run.next();
+            }
+            if (!currentTombstone || keepTombstones) {
+                hasCurrent = true;
+                return;
+            }
+        }
+    }
+
+public:
+    MergeCursor(const Memtable* memtable, const std::vector<SortedRun*>& sources, const Key& from, bool tombstones)
+        : keepTombstones(tombstones) {
+        if (memtable != nullptr) {
+            mem = memtable->lower_bound(from);
+            memEnd = memtable->end();
+        }
+        for (SortedRun* run : sources) runs.emplace_back(*run, from);
+        current.reserved = 0;
+        current.offset = 0;
+        advance();
+    }
+
+    bool valid() const {
+        return hasCurrent;
+    }
+
+    // The offset is unused and zero
+    const Entry& entry() const {
+        return current;
+    }
+
+    bool tombstone() const {
+        return currentTombstone;
+    }
+
+    void next() {
+        advance();
+    }
+};
+
+// Log-structured merge engine with the same interface as FileStorage.
+// Writes go to a write-ahead log and a bounded memtable, which is written
+// out as a level 0 run when full. Level 0 runs are merged into level 1 once
+// LSM_LEVEL0_RUNS accumulate, and a level that outgrows its share is merged
+// into the next, so a lookup reads at most one block per run. The manifest
+// lists the live runs and is replaced atomically after every change.
+class LsmStorage {
+private:
+    StorageOptions options;
+    std::string base;
+    Memtable memtable;
+    std::vector<std::unique_ptr<SortedRun>> level0;   // Newest first
+    std::vector<std::unique_ptr<SortedRun>> levels;   // levels[i] is level i + 1, may be null
+    uint64_t nextRunId = 1;
+
+    RandomAccessFile wal;
+    std::string pendingWal;
+    uint64_t walBytes = 0;       // Written to the file, before pendingWal
+    uint64_t walFirstLsn = 1;
+    uint64_t nextLsn = 1;
+    uint32_t opsSinceFlush = 0;
+    std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
+
+    BloomFilter bloom;
+
+    std::string runPath(uint64_t id) const {
+        return base + ".run." + std::to_string(id);
+    }
+
+    std::unique_ptr<SortedRun> openRun(uint64_t id) {
+        auto run = std::make_unique<SortedRun>();
+        if (!run->open(runPath(id), id)) {
+            std::cerr << runPath(id) << ": unreadable run" << std::endl;
+            exit(1);
+        }
+        return run;
+    }
+
+    // Every run, newest first
+    std::vector<SortedRun*> allRuns() const {
+        std::vector<SortedRun*> runs;
+        for (auto& run : level0) runs.push_back(run.get());
+        for (auto& run : levels) {
+            if (run) runs.push_back(run.get());
+        }
+        return runs;
+    }
+
+    void readManifest() {
+        std::ifstream in(base + ".manifest", std::ios::in | std::ios::binary);
+        ManifestHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return;
+        if (header.magic != MANIFEST_MAGIC || header.version != MANIFEST_VERSION) {
+            std::cerr << base << ".manifest: unsupported format" << std::endl;
+            exit(1);
+        }
+        nextRunId = header.nextRunId;
+        for (uint64_t i = 0; i < header.runCount; i++) {
+            ManifestRun run;
+            if (!in.read(reinterpret_cast<char*>(&run), sizeof(run))) break;
+            if (run.level == 0) {
+                level0.push_back(openRun(run.id));
+            } else {
+                if (levels.size() < run.level) levels.resize(run.level);
+                levels[run.level - 1] = openRun(run.id);
+            }
+        }
+    }
+
+    void writeManifest() {
+        std::vector<ManifestRun> runs;
+        for (auto& run : level0) runs.push_back(ManifestRun{0, 0, run->id});
+        for (size_t i = 0; i < levels.size(); i++) {
+            if (levels[i]) runs.push_back(ManifestRun{static_cast<uint32_t>(i + 1), 0, levels[i]->id});
+        }
+
+        ManifestHeader header;
+        header.magic = MANIFEST_MAGIC;
+        header.version = MANIFEST_VERSION;
+        header.nextRunId = nextRunId;
+        header.runCount = runs.size();
+
+        std::string tmp = base + ".manifest.tmp";
+        std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(runs.data()), runs.size() * sizeof(ManifestRun));
+        out.close();
+        requireIo(!out.fail(), tmp, "write");
+        replaceFile(tmp, base + ".manifest");
+    }
+
+    // Refill the memtable from the log, which ends at its first torn or
+    // corrupt record
+    void replayWal() {
+        std::string path = base + ".wal";
+        DataFileReader reader;
+        uint64_t offset = DATA_HEADER_BYTES;
+        if (reader.open(path)) {
+            const char* bytes = reader.at(0, sizeof(DataHeader));
+            DataHeader header;
+            if (bytes != nullptr) {
+                memcpy(&header, bytes, sizeof(header));
+                walFirstLsn = header.firstLsn;
+            }
+            for (uint64_t lsn = walFirstLsn; bytes != nullptr; offset += sizeof(DataRecord), lsn++) {
+                bytes = reader.at(offset, sizeof(DataRecord));
+                const DataRecord* record = reinterpret_cast<const DataRecord*>(bytes);
+                if (bytes == nullptr || !validRecord(*record, lsn)) break;
+                memtable[record->key] = record->kind == RECORD_TOMBSTONE;
+            }
+            reader.close();
+        }
+
+        nextLsn = walFirstLsn + (offset - DATA_HEADER_BYTES) / sizeof(DataRecord);
+        if (memtable.empty()) {
+            resetWal();
+            return;
+        }
+        wal.open(path, FileMode::ReadWrite);
+        wal.truncate(offset);
+        walBytes = offset;
+    }
+
+    // Start an empty log once the memtable is safely in a run
+    void resetWal() {
+        pendingWal.clear();
+        walFirstLsn = nextLsn;
+        wal.open(base + ".wal", FileMode::Truncate);
+        appendDataHeader(pendingWal, 0, walFirstLsn);
+        walBytes = 0;
+        flushWal();
+    }
+
+    void flushWal() {
+        if (!pendingWal.empty()) {
+            FILESTORAGE_TIME(Timer::LogFlush);
+            FILESTORAGE_COUNT(Stat::LogFlushes, 1);
+            requireIo(wal.write(walBytes, pendingWal.data(), pendingWal.size()), wal, "append");
+            walBytes += pendingWal.size();
+            pendingWal.clear();
+        }
+        opsSinceFlush = 0;
+        lastFlush = std::chrono::steady_clock::now();
+    }
+
+    void apply(const Key& key, bool tombstone) {
+        appendDataRecord(pendingWal, key, tombstone ? RECORD_TOMBSTONE : RECORD_INSERT, tombstone, nextLsn++);
+        switch (options.durability) {
+        case Durability::PerOp:
+            flushWal();
+            requireIo(wal.sync(), wal, "fdatasync");
+            break;
+        case Durability::Periodic:
+            if (++opsSinceFlush >= options.flushEveryOps ||
+                std::chrono::steady_clock::now() - lastFlush >= std::chrono::milliseconds(options.flushIntervalMs)) {
+                flushWal();
+            }
+            break;
+        case Durability::OnExit:
+            break;
+        }
+        if (pendingWal.size() >= WRITE_BUFFER_BYTES) flushWal();
+
+        memtable[key] = tombstone;
+        if (!tombstone) {
+            bloom.add(std::string_view(key.index, strnlen(key.index, KEY_BYTES)));
+        }
+        if (memtable.size() >= options.memtableKeys) {
+            flushMemtable();
+        }
+    }
+
+    // Merge sources (newest first) into a new run; tombstones are dropped
+    // when nothing older than the output remains below it
+    std::unique_ptr<SortedRun> mergeRuns(const std::vector<SortedRun*>& sources, bool bottom) {
+        uint64_t id = nextRunId++;
+        RunWriter writer(runPath(id));
+        Key from;
+        memset(&from, 0, sizeof(from));
+        from.value = INT_MIN;
+        for (MergeCursor cursor(nullptr, sources, from, !bottom); cursor.valid(); cursor.next()) {
+            writer.add(cursor.entry().key, cursor.tombstone());
+        }
+        writer.finish();
+        return openRun(id);
+    }
+
+    bool deepest(size_t level) const {
+        for (size_t i = level; i < levels.size(); i++) {
+            if (levels[i]) return false;
+        }
+        return true;
+    }
+
+    void flushMemtable() {
+        flushWal();
+        uint64_t id = nextRunId++;
+        RunWriter writer(runPath(id));
+        for (auto& entry : memtable) writer.add(entry.first, entry.second);
+        writer.finish();
+        level0.insert(level0.begin(), openRun(id));
+        memtable.clear();
+
+        std::vector<std::string> obsolete;
+        if (level0.size() >= LSM_LEVEL0_RUNS) {
+            if (levels.empty()) levels.resize(1);
+            std::vector<SortedRun*> sources;
+            for (auto& run : level0) sources.push_back(run.get());
+            if (levels[0]) sources.push_back(levels[0].get());
+            std::unique_ptr<SortedRun> merged = mergeRuns(sources, deepest(1));
+
+            for (SortedRun* run : sources) obsolete.push_back(run->path);
+            level0.clear();
+            levels[0] = std::move(merged);
+
+            // Push down every level that outgrew its share
+            uint64_t capacity = options.memtableKeys * LSM_LEVEL0_RUNS * LSM_LEVEL_RATIO;
+            for (size_t i = 0; i < levels.size(); i++, capacity *= LSM_LEVEL_RATIO) {
+                if (!levels[i] || levels[i]->entries() <= capacity) continue;
+                if (levels.size() == i + 1) levels.resize(i + 2);
+                std::vector<SortedRun*> pair{levels[i].get()};
+                if (levels[i + 1]) pair.push_back(levels[i + 1].get());
+                std::unique_ptr<SortedRun> next = mergeRuns(pair, deepest(i + 2));
+                for (SortedRun* run : pair) obsolete.push_back(run->path);
+                levels[i].reset();
+                levels[i + 1] = std::move(next);
+            }
+        }
+
+        // The new runs must be live before the log and the inputs go. Run
+        // and manifest failures exit before this, with the log still whole.
+        writeManifest();
+        resetWal();
+        for (const std::string& path : obsolete) ::remove(path.c_str());
+    }
+
+    // Refill the Bloom filter with every live index, sized by the entry
+    // count of all runs, which bounds the live keys
+    void rebuildBloom() {
+        uint64_t entries = memtable.size();
+        for (SortedRun* run : allRuns()) entries += run->entries();
+        bloom.reset(2 * std::max(entries, bloom.keys()));
+        Key from;
+        memset(&from, 0, sizeof(from));
+        from.value = INT_MIN;
+
+        Key previous = from;
+        for (MergeCursor cursor = seek(from); cursor.valid(); cursor.next()) {
+            const Key& key = cursor.entry().key;
+            if (!sameIndex(key, previous)) {
+                bloom.add(std::string_view(key.index, strnlen(key.index, KEY_BYTES)));
+                previous = key;
+            }
+        }
+    }
+
+public:
+    using Cursor = MergeCursor;
+
+    // Whether a store of this engine lives under name
+    static bool hasFiles(const std::string& name) {
+        return std::filesystem::exists(name + ".manifest") || std::filesystem::exists(name + ".wal");
+    }
+
+    static void removeFiles(const std::string& name) {
+        for (const char* suffix : {".wal", ".manifest", ".manifest.tmp", ".bloom"}) {
+            ::remove((name + suffix).c_str());
+        }
+        std::filesystem::path store(name);
+        std::string runPrefix = store.filename().string() + ".run.";
+        std::error_code error;
+        std::filesystem::path dir = store.has_parent_path() ? store.parent_path() : std::filesystem::path(".");
+        for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+            if (entry.path().filename().string().rfind(runPrefix, 0) == 0) ::remove(entry.path().c_str());
+        }
+    }
+
+    explicit LsmStorage(const StorageOptions& storageOptions = StorageOptions(),
+                        const std::string& name = DEFAULT_STORE)
+        : options(storageOptions), base(name) {
+        options.memtableKeys = std::max<size_t>(options.memtableKeys, 1);
+        readManifest();
+        replayWal();
+        // The filter saved at shutdown holds unless writes came after it
+        if (!bloom.load(base + ".bloom", nextLsn)) {
+            rebuildBloom();
+        }
+    }
+
+    ~LsmStorage() {
+        // The memtable stays in the log and is replayed on the next start
+        flushWal();
+        bloom.save(base + ".bloom", nextLsn);
+    }
+
+    void insert(std::string_view index, int value) {
+        apply(makeKey(index, value), false);
+        if (bloom.overfull()) rebuildBloom();
+    }
+
+    void remove(std::string_view index, int value) {
+        if (!bloom.mayContain(index)) return;
+        apply(makeKey(index, value), true);
+    }
+
+    // Calls visit(value) for every value of an index in ascending order,
+    // reading only the runs whose key range covers the index
+    template <typename Visitor>
+    void forEachValue(std::string_view index, Visitor visit) {
+        forEachValueFrom(index, INT_MIN, [&](int value) {
+            visit(value);
+            return true;
+        });
+    }
+
+    // Calls visit(value) for the values >= first of an index in ascending
+    // order until it returns false; each run is entered at first's block
+    template <typename Visitor>
+    void forEachValueFrom(std::string_view index, int first, Visitor visit) {
+        if (!bloom.mayContain(index)) return;
+
+        Key from = makeKey(index, first);
+        std::vector<SortedRun*> sources;
+        for (SortedRun* run : allRuns()) {
+            if (run->overlaps(from, from)) sources.push_back(run);
+        }
+        for (MergeCursor cursor(&memtable, sources, from, false); cursor.valid(); cursor.next()) {
+            if (!sameIndex(cursor.entry().key, from)) return;
+            FILESTORAGE_COUNT(Stat::RecordsScanned, 1);
+            if (!visit(cursor.entry().key.value)) return;
+        }
+    }
+
+    // A tombstone in one run can cancel an entry in any older run, so per-run
+    // counts do not add up; the count comes from merging the index's entries
+    uint64_t countValues(std::string_view index) {
+        uint64_t count = 0;
+        forEachValue(index, [&](int) {
+            count++;
+        });
+        return count;
+    }
+
+    // The newest source that has the key decides, so older runs are only
+    // read when the newer ones do not mention it
+    bool contains(std::string_view index, int value) {
+        if (!bloom.mayContain(index)) return false;
+        Key key = makeKey(index, value);
+        auto pos = memtable.find(key);
+        if (pos != memtable.end()) return !pos->second;
+        for (SortedRun* run : allRuns()) {
+            if (!run->overlaps(key, key)) continue;
+            RunCursor cursor(*run, key);
+            if (cursor.valid() && compareKeys(cursor.entry().key, key) == 0) return !cursor.entry().tombstone;
+        }
+        return false;
+    }
+
+    // Lookups read one block per run and nothing else, so there is nothing
+    // worth reading ahead
+    void prefetch(const std::vector<Key>&) {}
+
+    // Cursor at the first live key >= from
+    MergeCursor seek(const Key& from) {
+        return MergeCursor(&memtable, allRuns(), from, false);
+    }
+
+    // Add the pairs of a text file of "index value" lines. Each pair is an
+    // ordinary blind write, which the memtable already turns into sorted
+    // runs.
+    LoadResult load(const std::string& path) {
+        LoadResult result;
+        PairFileReader in(path, result);
+        std::string_view index;
+        int value;
+        while (in.next(index, value)) insert(index, value);
+        flushWal();
+        return result;
+    }
+};
+
+// Epoch-based reclamation for objects that lock-free readers may still be
+// using. A reader announces the global epoch for the length of a Guard; an
+// object unlinked and retired at epoch e can be freed once every announced
+// epoch is later than e.
+class EpochReclaimer {
+private:
+    static constexpr size_t MAX_READERS = 128;
+    static constexpr uint64_t IDLE = 0;
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{IDLE};
+        std::atomic<bool> claimed{false};
+    };
+
+    static inline std::atomic<uint64_t> globalEpoch{1};
+
+    static ReaderSlot* readers() {
+        static ReaderSlot slots[MAX_READERS];
+        return slots;
+    }
+
+    // The calling thread's reader slot, released when the thread exits
+    struct ThreadSlot {
+        ReaderSlot* slot = nullptr;
+        uint32_t depth = 0;       // Nested guards on this thread
+
+        ThreadSlot() {
+            for (size_t i = 0; i < MAX_READERS; i++) {
+                if (!readers()[i].claimed.exchange(true)) {
+                    slot = &readers()[i];
+                    break;
+                }
+            }
+        }
+
+        ~ThreadSlot() {
+            if (slot != nullptr) slot->claimed.store(false);
+        }
+    };
+
+    static ThreadSlot& threadSlot() {
+        thread_local ThreadSlot local;
+        return local;
+    }
+
+public:
+    // Read-side critical section. Inactive when every reader slot is taken,
+    // in which case the caller must not touch shared objects.
+    class Guard {
+    private:
+        ThreadSlot& local;
+
+    public:
+        Guard() : local(threadSlot()) {
+            if (local.slot != nullptr && local.depth++ == 0) {
+                local.slot->epoch.store(globalEpoch.load());
+            }
+        }
+
+        ~Guard() {
+            if (local.slot != nullptr && --local.depth == 0) {
+                local.slot->epoch.store(IDLE);
+            }
+        }
+
+        bool active() const {
+            return local.slot != nullptr;
+        }
+    };
+
+    // Epoch to tag an object with right after it was unlinked
+    static uint64_t retire() {
+        return globalEpoch.fetch_add(1);
+    }
+
+    // Objects retired at an epoch before this one are unreachable
+    static uint64_t safeEpoch() {
+        uint64_t oldest = globalEpoch.load();
+        for (size_t i = 0; i < MAX_READERS; i++) {
+            uint64_t epoch = readers()[i].epoch.load();
+            if (epoch != IDLE) oldest = std::min(oldest, epoch);
+        }
+        return oldest;
+    }
+};
+
+// Immutable, sorted copy of one index's values
+struct ValueSnapshot {
+    Key index;                // Value field unused
+    std::vector<int> values;
+};
+
+// Direct-mapped table of ValueSnapshots that readers search without a lock.
+// Only the owner of the shard lock publishes or replaces snapshots; replaced
+// ones are freed through EpochReclaimer.
+class SnapshotTable {
+private:
+    static constexpr size_t MAX_VALUES = 4096;    // Longer lists are not cached
+    static constexpr size_t RECLAIM_BATCH = 64;
+
+    std::unique_ptr<std::atomic<ValueSnapshot*>[]> slots;
+    size_t mask = 0;
+    std::vector<std::pair<uint64_t, ValueSnapshot*>> retired;
+
+    // Swap in snapshot and retire the one it displaces
+    void publish(std::atomic<ValueSnapshot*>& slot, ValueSnapshot* snapshot) {
+        ValueSnapshot* old = slot.exchange(snapshot);
+        if (old == nullptr) return;
+        retired.emplace_back(EpochReclaimer::retire(), old);
+        if (retired.size() >= RECLAIM_BATCH) reclaim();
+    }
+
+    void reclaim() {
+        uint64_t safe = EpochReclaimer::safeEpoch();
+        size_t kept = 0;
+        for (auto& entry : retired) {
+            if (entry.first < safe) {
+                delete entry.second;
+            } else {
+                retired[kept++] = entry;
+            }
+        }
+        retired.resize(kept);
+    }
+
+public:
+    explicit SnapshotTable(size_t slotCount) {
+        size_t capacity = 1;
+        while (capacity < slotCount) capacity *= 2;
+        slots.reset(new std::atomic<ValueSnapshot*>[capacity]);
+        for (size_t i = 0; i < capacity; i++) slots[i].store(nullptr);
+        mask = capacity - 1;
+    }
+
+    // Drop every cached list (shard lock held)
+    void clear() {
+        for (size_t i = 0; i <= mask; i++) publish(slots[i], nullptr);
+    }
+
+    // Only once no reader can be inside a Guard
+    ~SnapshotTable() {
+        for (size_t i = 0; i <= mask; i++) delete slots[i].load();
+        for (auto& entry : retired) delete entry.second;
+    }
+
+    // Call inside an active EpochReclaimer::Guard; the result stays valid
+    // until the guard ends
+    const ValueSnapshot* find(uint64_t hash, const Key& index) const {
+        ValueSnapshot* snapshot = slots[hash & mask].load();
+        return snapshot != nullptr && sameIndex(snapshot->index, index) ? snapshot : nullptr;
+    }
+
+    // Cache the complete value list of an index (shard lock held)
+    void store(uint64_t hash, const Key& index, std::vector<int> values) {
+        if (values.size() > MAX_VALUES) return;
+        publish(slots[hash & mask], new ValueSnapshot{index, std::move(values)});
+    }
+
+    // Apply an insert (or delete) of value to a cached list (shard lock held)
+    void update(uint64_t hash, const Key& index, int value, bool inserted) {
+        std::atomic<ValueSnapshot*>& slot = slots[hash & mask];
+        const ValueSnapshot* current = slot.load();
+        if (current == nullptr || !sameIndex(current->index, index)) return;
+
+        const std::vector<int>& values = current->values;
+        auto pos = values.begin() + lowerBoundValue(values.data(), values.size(), value);
+        bool present = pos != values.end() && *pos == value;
+        if (present == inserted) return;
+        if (inserted && values.size() >= MAX_VALUES) {
+            publish(slot, nullptr);
+            return;
+        }
+
+        std::vector<int> next;
+        next.reserve(values.size() + inserted);
+        next.insert(next.end(), values.begin(), pos);
+        if (inserted) next.push_back(value);
+        next.insert(next.end(), present ? pos + 1 : pos, values.end());
+        publish(slot, new ValueSnapshot{index, std::move(next)});
+    }
+};
+
+// Engine opens a store that the other engine left under name by dumping it
+// in key order as "index value" lines and removing its files; the caller
+// bulk-loads the returned dump and then removes it, or gets "" when there
+// is nothing to import. Without this the store would open empty and the
+// old files would be written over. The dump appears only once complete, so
+// an import cut short resumes from it on the next open.
+template <typename Engine>
+std::string exportForeignStore(const StorageOptions& options, const std::string& name) {
+    using Foreign = std::conditional_t<std::is_same_v<Engine, FileStorage>, LsmStorage, FileStorage>;
+    std::string dump = name + ".import";
+    if (!std::filesystem::exists(dump)) {
+        if (!Foreign::hasFiles(name)) return "";
+        if (Engine::hasFiles(name)) {
+            std::cerr << name << ": holds the files of both storage engines" << std::endl;
+            exit(1);
+        }
+
+        std::string tmp = dump + ".tmp";
+        {
+            Foreign store(options, name);
+            std::ofstream out(tmp, std::ios::out | std::ios::trunc);
+            Key from;
+            memset(&from, 0, sizeof(from));
+            from.value = INT_MIN;
+            for (auto cursor = store.seek(from); cursor.valid(); cursor.next()) {
+                const Key& key = cursor.entry().key;
+                out.write(key.index, strnlen(key.index, KEY_BYTES)) << ' ' << key.value << '\n';
+            }
+            if (!out.flush()) {
+                std::cerr << tmp << ": write failed" << std::endl;
+                exit(1);
+            }
+        }
+        rename(tmp.c_str(), dump.c_str());
+    }
+    Foreign::removeFiles(name);
+    return dump;
+}
+
+// Hash-partitions indexes over independent engine shards, each with its
+// own files and lock, so calls on different threads that land on different
+// shards run in parallel. All values of an index live in one shard. A single
+// shard keeps the unsharded file names.
+template <typename Engine = FileStorage>
+class ShardedStorage {
+private:
+    struct Shard {
+        std::string name;    // Base name of the shard's files
+        std::mutex lock;
+        std::unique_ptr<Engine> storage;
+        std::unique_ptr<SnapshotTable> snapshots;   // Null when snapshots are off
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    static uint64_t hashIndex(std::string_view index) {
+        // Longer indexes are truncated to KEY_BYTES, so hash only that much
+        uint64_t hash = fnv1a(index.substr(0, KEY_BYTES));
+        // Mixed differently from the Bloom filter hash, whose low bits pick
+        // a block inside the shard
+        hash ^= hash >> 29;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    // The low half of the hash picks the shard, the high half a snapshot slot
+    size_t shardIndex(uint64_t hash) const {
+        return (hash & 0xffffffffull) * shards.size() >> 32;
+    }
+
+    Shard& shardFor(uint64_t hash) {
+        return *shards[shardIndex(hash)];
+    }
+
+    // Answers a read of index from its cached value list when there is one,
+    // by hit(values) without taking any lock; otherwise by miss(shard) under
+    // the shard lock
+    template <typename Hit, typename Miss>
+    auto withSnapshotOrShard(std::string_view index, Hit hit, Miss miss) {
+        uint64_t hash = hashIndex(index);
+        Shard& shard = shardFor(hash);
+        if (shard.snapshots) {
+            EpochReclaimer::Guard epoch;
+            if (epoch.active()) {
+                if (const ValueSnapshot* snapshot = shard.snapshots->find(hash >> 32, makeKey(index, 0))) {
+                    FILESTORAGE_COUNT(Stat::SnapshotHits, 1);
+                    return hit(snapshot->values);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return miss(shard);
+    }
+
+    // Merges the shards' entries in key order, starting at from and ending
+    // at the first key that inRange rejects. Indexes never span shards, so
+    // this is a plain k-way merge. All shard locks are held throughout.
+    template <typename InRange, typename Visitor>
+    void scanFrom(const Key& from, InRange inRange, Visitor visit) {
+        FILESTORAGE_TIME(Timer::Scan);
+        std::vector<std::unique_lock<std::mutex>> locks;
+        std::vector<typename Engine::Cursor> cursors;
+        for (auto& shard : shards) {
+            locks.emplace_back(shard->lock);
+            cursors.push_back(shard->storage->seek(from));
+        }
+
+        while (true) {
+            size_t best = cursors.size();
+            for (size_t i = 0; i < cursors.size(); i++) {
+                if (cursors[i].valid() &&
+                    (best == cursors.size() || compareKeys(cursors[i].entry().key, cursors[best].entry().key) < 0)) {
+                    best = i;
+                }
+            }
+            if (best == cursors.size()) return;
+
+            const Key& key = cursors[best].entry().key;
+            if (!inRange(key)) return;
+            FILESTORAGE_COUNT(Stat::RecordsScanned, 1);
+            visit(std::string_view(key.index, strnlen(key.index, KEY_BYTES)), key.value);
+            cursors[best].next();
+        }
+    }
+
+    // Writes the pairs of a scan on one line as "index value ...", or null
+    template <typename Scan>
+    static void writePairs(OutputWriter& out, Scan scan) {
+        bool first = true;
+        scan([&](std::string_view index, int value) {
+            if (!first) out.put(' ');
+            out.write(index.data(), index.size());
+            out.put(' ');
+            out.writeInt(value);
+            first = false;
+        });
+
+        if (first) out.write("null", 4);
+        out.put('\n');
+    }
+
+public:
+    explicit ShardedStorage(const StorageOptions& options = StorageOptions()) {
+        unsigned count = std::max(options.shards, 1u);
+        StorageOptions shardOptions = options;
+        shardOptions.cacheBytes = options.cacheBytes / count;
+
+        for (unsigned i = 0; i < count; i++) {
+            std::string name = count == 1 ? DEFAULT_STORE : DEFAULT_STORE + "-" + std::to_string(i);
+            shards.push_back(std::make_unique<Shard>());
+            shards.back()->name = name;
+            std::string dump = exportForeignStore<Engine>(shardOptions, name);
+            shards.back()->storage = std::make_unique<Engine>(shardOptions, name);
+            if (!dump.empty()) {
+                shards.back()->storage->load(dump);
+                ::remove(dump.c_str());
+            }
+            if (options.snapshotSlots > 0) {
+                shards.back()->snapshots = std::make_unique<SnapshotTable>(options.snapshotSlots);
+            }
+        }
+    }
+
+    void insert(std::string_view index, int value) {
+        FILESTORAGE_TIME(Timer::Insert);
+        uint64_t hash = hashIndex(index);
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.storage->insert(index, value);
+        if (shard.snapshots) {
+            shard.snapshots->update(hash >> 32, makeKey(index, 0), value, true);
+        }
+    }
+
+    void remove(std::string_view index, int value) {
+        FILESTORAGE_TIME(Timer::Delete);
+        uint64_t hash = hashIndex(index);
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.storage->remove(index, value);
+        if (shard.snapshots) {
+            shard.snapshots->update(hash >> 32, makeKey(index, 0), value, false);
+        }
+    }
+
+    // out is not synchronized; concurrent callers need writers of their own
+    void find(std::string_view index, OutputWriter& out) {
+        bool first = true;
+        forEachValue(index, [&](int value) {
+            if (!first) out.put(' ');
+            out.writeInt(value);
+            first = false;
+        });
+
+        if (first) out.write("null", 4);
+        out.put('\n');
+    }
+
+    // Calls visit(value) for every value of an index in ascending order.
+    // With snapshots on, a cached index is read without taking any lock;
+    // otherwise visit runs under the index's shard lock.
+    template <typename Visitor>
+    void forEachValue(std::string_view index, Visitor visit) {
+        FILESTORAGE_TIME(Timer::Find);
+        std::vector<int> values;
+        bool listed = withSnapshotOrShard(index, [&](const std::vector<int>& cached) {
+            for (int value : cached) visit(value);
+            return false;
+        }, [&](Shard& shard) {
+            if (!shard.snapshots) {
+                shard.storage->forEachValue(index, visit);
+                return false;
+            }
+            // Miss: read the tree and cache the list for the next reader
+            shard.storage->forEachValue(index, [&](int value) {
+                values.push_back(value);
+            });
+            shard.snapshots->store(hashIndex(index) >> 32, makeKey(index, 0), values);
+            return true;
+        });
+        // Visited once the lock is dropped
+        if (listed) {
+            for (int value : values) visit(value);
+        }
+    }
+
+    // Calls visit(value) for the values above after of an index, in
+    // ascending order, until it returns false. A cached snapshot is searched
+    // for the first one; otherwise the engine's scan starts there. Nothing
+    // is cached, as only part of the list may be read.
+    template <typename Visitor>
+    void forEachValueAfter(std::string_view index, int64_t after, Visitor visit) {
+        FILESTORAGE_TIME(Timer::Find);
+        if (after >= INT_MAX) return;
+        int first = after < INT_MIN ? INT_MIN : static_cast<int>(after + 1);
+        withSnapshotOrShard(index, [&](const std::vector<int>& values) {
+            for (size_t pos = lowerBoundValue(values.data(), values.size(), first); pos < values.size(); pos++) {
+                if (!visit(values[pos])) return;
+            }
+        }, [&](Shard& shard) {
+            shard.storage->forEachValueFrom(index, first, visit);
+        });
+    }
+
+    // Read ahead what lookups of indexes will need, one batch per shard
+    void prefetch(const std::vector<std::string_view>& indexes) {
+        std::vector<std::vector<Key>> keys(shards.size());
+        for (std::string_view index : indexes) {
+            keys[shardIndex(hashIndex(index))].push_back(makeKey(index, INT_MIN));
+        }
+        for (size_t i = 0; i < shards.size(); i++) {
+            if (keys[i].empty()) continue;
+            std::lock_guard<std::mutex> guard(shards[i]->lock);
+            shards[i]->storage->prefetch(keys[i]);
+        }
+    }
+
+    // Number of values of an index. A cached snapshot answers without the
+    // shard lock; otherwise the engine counts without listing the values,
+    // and nothing is cached.
+    uint64_t countValues(std::string_view index) {
+        FILESTORAGE_TIME(Timer::Count);
+        return withSnapshotOrShard(index, [&](const std::vector<int>& values) -> uint64_t {
+            return values.size();
+        }, [&](Shard& shard) {
+            return shard.storage->countValues(index);
+        });
+    }
+
+    // Whether (index, value) is stored, by a point search; snapshots are
+    // used as in countValues
+    bool contains(std::string_view index, int value) {
+        FILESTORAGE_TIME(Timer::Exists);
+        return withSnapshotOrShard(index, [&](const std::vector<int>& values) {
+            size_t pos = lowerBoundValue(values.data(), values.size(), value);
+            return pos < values.size() && values[pos] == value;
+        }, [&](Shard& shard) {
+            return shard.storage->contains(index, value);
+        });
+    }
+
+    std::vector<int> values(std::string_view index) {
+        std::vector<int> result;
+        forEachValue(index, [&](int value) {
+            result.push_back(value);
+        });
+        return result;
+    }
+
+    // Calls visit(index, value) for every pair with lo <= index <= hi, in
+    // (index, value) order
+    template <typename Visitor>
+    void forEachInRange(std::string_view lo, std::string_view hi, Visitor visit) {
+        Key last = makeKey(hi, 0);
+        scanFrom(makeKey(lo, INT_MIN), [&](const Key& key) {
+            return memcmp(key.index, last.index, KEY_BYTES) <= 0;
+        }, visit);
+    }
+
+    // Calls visit(index, value) for every pair whose index starts with
+    // prefix, in (index, value) order
+    template <typename Visitor>
+    void forEachWithPrefix(std::string_view prefix, Visitor visit) {
+        prefix = prefix.substr(0, KEY_BYTES);
+        scanFrom(makeKey(prefix, INT_MIN), [&](const Key& key) {
+            return memcmp(key.index, prefix.data(), prefix.size()) == 0;
+        }, visit);
+    }
+
+    // Bulk-load a text file of "index value" lines; see FileStorage::load.
+    // With several shards the file is first split into one part per shard,
+    // in a single pass, and each shard then loads its own part.
+    LoadResult load(const std::string& path) {
+        FILESTORAGE_TIME(Timer::Load);
+        LoadResult result;
+        if (shards.size() == 1) {
+            std::lock_guard<std::mutex> guard(shards[0]->lock);
+            result = shards[0]->storage->load(path);
+            if (shards[0]->snapshots) shards[0]->snapshots->clear();
+            return result;
+        }
+
+        {
+            PairFileReader in(path, result);
+            if (!result.opened) return result;
+            std::vector<std::ofstream> parts;
+            for (auto& shard : shards) {
+                parts.emplace_back(shard->name + ".load", std::ios::out | std::ios::trunc);
+            }
+            std::string_view index;
+            int value;
+            while (in.next(index, value)) {
+                parts[shardIndex(hashIndex(index))] << index << ' ' << value << '\n';
+            }
+            for (size_t i = 0; i < parts.size(); i++) {
+                parts[i].close();
+                requireIo(!parts[i].fail(), shards[i]->name + ".load", "write");
+            }
+        }
+
+        for (auto& shard : shards) {
+            std::string part = shard->name + ".load";
+            std::lock_guard<std::mutex> guard(shard->lock);
+            shard->storage->load(part);
+            if (shard->snapshots) shard->snapshots->clear();
+            ::remove(part.c_str());
+        }
+        return result;
+    }
+
+    void range(std::string_view lo, std::string_view hi, OutputWriter& out) {
+        writePairs(out, [&](auto visit) {
+            forEachInRange(lo, hi, visit);
+        });
+    }
+
+    void prefix(std::string_view prefix, OutputWriter& out) {
+        writePairs(out, [&](auto visit) {
+            forEachWithPrefix(prefix, visit);
+        });
+    }
+
+    // Writes up to limit values above after of an index on one line, or
+    // null. A page shorter than limit is the last one; the next page starts
+    // after the last value written.
+    void findPage(std::string_view index, int64_t after, uint64_t limit, OutputWriter& out) {
+        uint64_t written = 0;
+        if (limit > 0) {
+            forEachValueAfter(index, after, [&](int value) {
+                if (written > 0) out.put(' ');
+                out.writeInt(value);
+                return ++written < limit;
+            });
+        }
+
+        if (written == 0) out.write("null", 4);
+        out.put('\n');
+    }
+
+    void count(std::string_view index, OutputWriter& out) {
+        std::string digits = std::to_string(countValues(index));
+        out.write(digits.data(), digits.size());
+        out.put('\n');
+    }
+
+    void exists(std::string_view index, int value, OutputWriter& out) {
+        if (contains(index, value)) out.write("true\n", 5);
+        else out.write("false\n", 6);
+    }
+};
+
+}  // namespace filestorage
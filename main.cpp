@@ -1,238 +1,752 @@
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
+#include <string_view>
 #include <vector>
 #include <algorithm>
 #include <cstring>
 #include <cstdint>
+#include <cstdio>
 
-using namespace std;
-
-const string DATA_FILE = "storage.db";
+#include "file_storage.h"
 
-struct IndexInfo {
-    vector<int> values;  // Sorted values for this index
-};
+using namespace std;
+using namespace filestorage;
 
-class FileStorage {
+// Sorted set of ints kept as a list of bounded chunks (an unrolled list).
+// Inserts and deletes binary-search for the chunk and shift at most one
+// chunk, so they cost O(log k + CHUNK_VALUES) instead of O(k).
+class ChunkedValueSet {
 private:
-    fstream dataFile;
-    unordered_map<string, IndexInfo> indexMap;
-
-    // Write entry to file
-    void writeEntry(const string& index, int value) {
-        dataFile.seekp(0, ios::end);
+    static constexpr size_t CHUNK_VALUES = 256;
+
+    vector<vector<int>> chunks;   // Non-empty, ordered, non-overlapping
+    size_t count = 0;
+
+    // The chunk that holds value, or the one it would be inserted into
+    size_t chunkFor(int value) const {
+        size_t lo = 0, hi = chunks.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (chunks[mid].back() < value) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo == chunks.size() ? lo - 1 : lo;
+    }
 
-        uint8_t deleted = 0;  // Not deleted
-        uint32_t indexLen = index.length();
-        dataFile.write(reinterpret_cast<const char*>(&deleted), sizeof(deleted));
-        dataFile.write(reinterpret_cast<const char*>(&indexLen), sizeof(indexLen));
-        dataFile.write(index.c_str(), indexLen);
-        dataFile.write(reinterpret_cast<const char*>(&value), sizeof(value));
+public:
+    void clear() {
+        chunks.clear();
+        count = 0;
+    }
 
-        dataFile.flush();
+    bool empty() const {
+        return count == 0;
     }
 
-    // Find and mark entry as deleted by scanning file
-    void markDeleted(const string& targetIndex, int targetValue) {
-        dataFile.seekg(0, ios::beg);
+    size_t size() const {
+        return count;
+    }
 
-        while (dataFile.good()) {
-            int32_t offset = dataFile.tellg();
+    // Add a value larger than every value already present
+    void append(int value) {
+        if (chunks.empty() || chunks.back().size() >= CHUNK_VALUES) {
+            chunks.emplace_back();
+            chunks.back().reserve(CHUNK_VALUES);
+        }
+        chunks.back().push_back(value);
+        count++;
+    }
 
-            uint8_t deleted;
-            dataFile.read(reinterpret_cast<char*>(&deleted), sizeof(deleted));
-            if (!dataFile.good() || dataFile.eof()) break;
+    bool contains(int value) const {
+        if (chunks.empty()) return false;
+        const vector<int>& chunk = chunks[chunkFor(value)];
+        size_t pos = lowerBoundValue(chunk.data(), chunk.size(), value);
+        return pos < chunk.size() && chunk[pos] == value;
+    }
 
-            uint32_t indexLen;
-            dataFile.read(reinterpret_cast<char*>(&indexLen), sizeof(indexLen));
-            if (!dataFile.good() || dataFile.eof()) break;
+    // Returns false if the value was already present
+    bool insert(int value) {
+        if (chunks.empty()) {
+            append(value);
+            return true;
+        }
 
-            if (indexLen > 256) break;
+        size_t slot = chunkFor(value);
+        vector<int>& chunk = chunks[slot];
+        auto pos = chunk.begin() + lowerBoundValue(chunk.data(), chunk.size(), value);
+        if (pos != chunk.end() && *pos == value) return false;
+        chunk.insert(pos, value);
+        count++;
+
+        // Split a chunk that has doubled
+        if (chunk.size() >= 2 * CHUNK_VALUES) {
+            vector<int> upper(chunk.begin() + CHUNK_VALUES, chunk.end());
+            chunk.resize(CHUNK_VALUES);
+            chunks.insert(chunks.begin() + slot + 1, move(upper));
+        }
+        return true;
+    }
 
-            string index;
-            index.resize(indexLen);
-            dataFile.read(&index[0], indexLen);
-            if (!dataFile.good() || dataFile.eof()) break;
+    // Returns false if the value was not present
+    bool erase(int value) {
+        if (chunks.empty()) return false;
+
+        size_t slot = chunkFor(value);
+        vector<int>& chunk = chunks[slot];
+        auto pos = chunk.begin() + lowerBoundValue(chunk.data(), chunk.size(), value);
+        if (pos == chunk.end() || *pos != value) return false;
+        chunk.erase(pos);
+        count--;
+
+        // Drop empty chunks and fold small neighbours together
+        if (chunk.empty()) {
+            chunks.erase(chunks.begin() + slot);
+        } else if (slot + 1 < chunks.size() && chunk.size() + chunks[slot + 1].size() <= CHUNK_VALUES) {
+            chunk.insert(chunk.end(), chunks[slot + 1].begin(), chunks[slot + 1].end());
+            chunks.erase(chunks.begin() + slot + 1);
+        }
+        return true;
+    }
 
-            int value;
-            dataFile.read(reinterpret_cast<char*>(&value), sizeof(value));
-            if (!dataFile.good() || dataFile.eof()) break;
+    // Calls visit(value) for every value in ascending order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const vector<int>& chunk : chunks) {
+            for (int value : chunk) visit(value);
+        }
+    }
 
-            // Check if this is the entry to delete
-            if (!deleted && index == targetIndex && value == targetValue) {
-                dataFile.seekp(offset);
-                uint8_t del = 1;
-                dataFile.write(reinterpret_cast<const char*>(&del), sizeof(del));
-                dataFile.flush();
-                return;
+    // Calls visit(value) for the values >= first in ascending order until
+    // it returns false
+    template <typename Visitor>
+    void forEachFrom(int first, Visitor visit) const {
+        if (chunks.empty()) return;
+        size_t slot = chunkFor(first);
+        size_t pos = lowerBoundValue(chunks[slot].data(), chunks[slot].size(), first);
+        for (; slot < chunks.size(); slot++, pos = 0) {
+            for (; pos < chunks[slot].size(); pos++) {
+                if (!visit(chunks[slot][pos])) return;
             }
         }
-        dataFile.clear();
+    }
+};
+
+// Keys of one batch window, interned back to back as [length:u8][bytes]
+// in a single arena and found through a flat open-addressing table. Lookups
+// take a string_view, so grouping a window allocates nothing per command.
+class KeyTable {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot {
+        uint32_t hash;
+        uint32_t id;
+    };
+
+    string arena;
+    vector<uint32_t> offsets;   // Key id -> arena offset of its length byte
+    vector<Slot> slots;
+    size_t mask = 0;
+
+    static uint32_t hashKey(string_view key) {
+        uint64_t hash = fnv1a(key);
+        return hash ^ hash >> 32;
     }
 
 public:
-    FileStorage() {
-        // Check if file exists
-        ifstream testFile(DATA_FILE);
-        bool fileExists = testFile.good();
-        testFile.close();
-
-        dataFile.open(DATA_FILE, ios::in | ios::out | ios::binary);
-
-        if (!fileExists) {
-            // Create new file
-            dataFile.close();
-            dataFile.open(DATA_FILE, ios::in | ios::out | ios::binary | ios::trunc);
-        } else {
-            // Load index from existing file
-            rebuildIndex();
+    explicit KeyTable(size_t maxKeys) {
+        size_t capacity = 16;
+        while (capacity < 2 * maxKeys) capacity *= 2;
+        slots.assign(capacity, Slot{0, EMPTY});
+        mask = capacity - 1;
+        offsets.reserve(maxKeys);
+    }
+
+    void clear() {
+        arena.clear();
+        offsets.clear();
+        fill(slots.begin(), slots.end(), Slot{0, EMPTY});
+    }
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    string_view key(uint32_t id) const {
+        const char* entry = arena.data() + offsets[id];
+        return string_view(entry + 1, static_cast<unsigned char>(entry[0]));
+    }
+
+    // Returns the id of key, assigning the next id if it is new. Keys are
+    // cut to KEY_BYTES, as they are in the index.
+    uint32_t intern(string_view key) {
+        key = key.substr(0, KEY_BYTES);
+        uint32_t hash = hashKey(key);
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.id == EMPTY) {
+                slot.hash = hash;
+                slot.id = offsets.size();
+                offsets.push_back(arena.size());
+                arena.push_back(static_cast<char>(key.length()));
+                arena.append(key.data(), key.length());
+                return slot.id;
+            }
+            if (slot.hash == hash && this->key(slot.id) == key) {
+                return slot.id;
+            }
         }
     }
+};
+
+// The optional "limit N" and "after V" of a find: at most limit values,
+// all greater than after. The defaults list every value.
+struct FindPage {
+    int64_t after = INT64_MIN;
+    uint64_t limit = UINT64_MAX;
 
-    ~FileStorage() {
-        dataFile.close();
+    bool partial() const {
+        return after != INT64_MIN || limit != UINT64_MAX;
     }
+};
 
-    // Rebuild index map from file (for persistence)
-    void rebuildIndex() {
-        indexMap.clear();
-        dataFile.seekg(0, ios::beg);
+// Batch mode: commands are read in windows and grouped by index, so an
+// index hit by several commands in a window is looked up once and only the
+// net change is written back. Output still follows command order; once the
+// buffered find results pass OUTPUT_BUDGET, the remaining groups of the
+// window run one command at a time instead.
+template <typename Storage>
+class BatchExecutor {
+private:
+    static constexpr size_t OUTPUT_BUDGET = 1 << 20;
+    static constexpr uint32_t NONE = UINT32_MAX;
+    // Groups whose index pages are read ahead together
+    static constexpr size_t PREFETCH_GROUPS = 32;
+
+    struct Command {
+        char type;
+        uint32_t key;           // Id in keys, which is also the group id
+        int value;
+        FindPage page;
+        uint32_t nextInGroup;   // Next command with the same key, or NONE
+        bool done;
+        size_t resultStart;
+        size_t resultBytes;
+    };
+
+    // Commands of one key, chained through Command::nextInGroup
+    struct Group {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    Storage& storage;
+    OutputWriter& out;
+    vector<Command> window;
+    size_t count = 0;
+
+    KeyTable keys;
+    vector<Group> groups;
+    vector<uint32_t> order;
+    vector<string_view> prefetchKeys;
+    string results;              // find output of executed groups
+    ChunkedValueSet values;      // current values of the group's index
+    unordered_map<int, bool> originallyPresent;
+
+    void executeDirect(const Command& command) {
+        string_view index = keys.key(command.key);
+        switch (command.type) {
+        case 'i':
+            storage.insert(index, command.value);
+            break;
+        case 'd':
+            storage.remove(index, command.value);
+            break;
+        case 'f':
+            if (command.page.partial()) storage.findPage(index, command.page.after, command.page.limit, out);
+            else storage.find(index, out);
+            break;
+        case 'c':
+            storage.count(index, out);
+            break;
+        case 'e':
+            storage.exists(index, command.value, out);
+            break;
+        }
+    }
 
-        while (dataFile.good()) {
-            int32_t offset = dataFile.tellg();
+    // Commands whose output is held in results until the window is written
+    static bool isQuery(char type) {
+        return type == 'f' || type == 'c' || type == 'e';
+    }
 
-            uint8_t deleted;
-            dataFile.read(reinterpret_cast<char*>(&deleted), sizeof(deleted));
-            if (!dataFile.good() || dataFile.eof()) break;
+    void appendCount(uint64_t count) {
+        results += to_string(count);
+        results.push_back('\n');
+    }
 
-            uint32_t indexLen;
-            dataFile.read(reinterpret_cast<char*>(&indexLen), sizeof(indexLen));
-            if (!dataFile.good() || dataFile.eof()) break;
+    void appendExists(bool present) {
+        results.append(present ? "true\n" : "false\n");
+    }
 
-            if (indexLen > 256) break; // Invalid entry
+    // Append one value of a find result, separated from the previous one
+    void appendValue(int value, bool first) {
+        char digits[INT_DIGITS];
+        if (!first) results.push_back(' ');
+        char* start = formatInt(value, digits + INT_DIGITS);
+        results.append(start, digits + INT_DIGITS - start);
+    }
 
-            string index;
-            index.resize(indexLen);
-            dataFile.read(&index[0], indexLen);
-            if (!dataFile.good() || dataFile.eof()) break;
+    // Append one page of the group's current values
+    void appendValues(const FindPage& page) {
+        uint64_t written = 0;
+        if (page.limit > 0 && page.after < INT_MAX) {
+            int first = page.after < INT_MIN ? INT_MIN : static_cast<int>(page.after + 1);
+            values.forEachFrom(first, [&](int value) {
+                appendValue(value, written == 0);
+                return ++written < page.limit;
+            });
+        }
+        if (written == 0) results.append("null");
+        results.push_back('\n');
+    }
 
-            int value;
-            dataFile.read(reinterpret_cast<char*>(&value), sizeof(value));
-            if (!dataFile.good() || dataFile.eof()) break;
+    // Run every command of one index, in order
+    void runGroup(uint32_t key) {
+        string_view index = keys.key(key);
+        bool hasFind = false;
+        for (uint32_t pos = groups[key].first; pos != NONE; pos = window[pos].nextInGroup) {
+            // Pages of a find read only part of the list, so they do not count
+            hasFind |= window[pos].type == 'f' && !window[pos].page.partial();
+        }
 
-            // Only add non-deleted entries
-            if (!deleted) {
-                indexMap[index].values.push_back(value);
+        // Writes alone gain nothing from loading the value list
+        if (!hasFind || groups[key].first == groups[key].last) {
+            for (uint32_t pos = groups[key].first; pos != NONE; pos = window[pos].nextInGroup) {
+                Command& command = window[pos];
+                command.resultStart = results.size();
+                if (command.type == 'f') {
+                    uint64_t written = 0;
+                    if (!command.page.partial()) {
+                        storage.forEachValue(index, [&](int value) {
+                            appendValue(value, written++ == 0);
+                        });
+                    } else if (command.page.limit > 0) {
+                        storage.forEachValueAfter(index, command.page.after, [&](int value) {
+                            appendValue(value, written == 0);
+                            return ++written < command.page.limit;
+                        });
+                    }
+                    if (written == 0) results.append("null");
+                    results.push_back('\n');
+                } else if (command.type == 'c') {
+                    appendCount(storage.countValues(index));
+                } else if (command.type == 'e') {
+                    appendExists(storage.contains(index, command.value));
+                } else {
+                    executeDirect(command);
+                }
+                command.resultBytes = results.size() - command.resultStart;
+                command.done = true;
             }
+            return;
         }
 
-        // Sort values for binary search
-        for (auto& entry : indexMap) {
-            sort(entry.second.values.begin(), entry.second.values.end());
+        values.clear();
+        originallyPresent.clear();
+        storage.forEachValue(index, [&](int value) {
+            values.append(value);
+        });
+
+        for (uint32_t pos = groups[key].first; pos != NONE; pos = window[pos].nextInGroup) {
+            Command& command = window[pos];
+            if (isQuery(command.type)) {
+                command.resultStart = results.size();
+                if (command.type == 'f') appendValues(command.page);
+                else if (command.type == 'c') appendCount(values.size());
+                else appendExists(values.contains(command.value));
+                command.resultBytes = results.size() - command.resultStart;
+            } else {
+                bool changed = command.type == 'i' ? values.insert(command.value)
+                                                   : values.erase(command.value);
+                if (changed) {
+                    // Presence before the first change is the stored state
+                    originallyPresent.emplace(command.value, command.type == 'd');
+                }
+            }
+            command.done = true;
         }
 
-        dataFile.clear(); // Clear flags
+        // Write back only values whose presence changed over the window
+        for (const auto& change : originallyPresent) {
+            bool present = values.contains(change.first);
+            if (change.second && !present) {
+                storage.remove(index, change.first);
+            } else if (!change.second && present) {
+                storage.insert(index, change.first);
+            }
+        }
+        values.clear();
     }
 
-    // Insert entry
-    void insert(const string& index, int value) {
-        // Check if (index, value) already exists using binary search
-        auto it = indexMap.find(index);
-        if (it != indexMap.end()) {
-            auto& values = it->second.values;
-            // Binary search for value
-            auto found = lower_bound(values.begin(), values.end(), value);
-            if (found != values.end() && *found == value) {
-                // Already exists, do nothing
-                return;
+    void run() {
+        // Visit indexes in key order so consecutive groups share index pages
+        order.clear();
+        for (uint32_t key = 0; key < groups.size(); key++) {
+            order.push_back(key);
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return keys.key(a) < keys.key(b);
+        });
+
+        results.clear();
+        for (size_t i = 0; i < order.size(); i++) {
+            if (results.size() > OUTPUT_BUDGET) break;
+            if (i % PREFETCH_GROUPS == 0) {
+                prefetchKeys.clear();
+                for (size_t j = i; j < min(order.size(), i + PREFETCH_GROUPS); j++) {
+                    prefetchKeys.push_back(keys.key(order[j]));
+                }
+                storage.prefetch(prefetchKeys);
             }
-            // Insert in sorted order
-            values.insert(found, value);
+            runGroup(order[i]);
+        }
 
-            // Write new entry to file
-            writeEntry(index, value);
-        } else {
-            // New index
-            indexMap[index].values.push_back(value);
-            writeEntry(index, value);
+        for (size_t i = 0; i < count; i++) {
+            const Command& command = window[i];
+            if (!command.done) {
+                executeDirect(command);
+            } else if (isQuery(command.type)) {
+                out.write(results.data() + command.resultStart, command.resultBytes);
+            }
         }
+
+        count = 0;
+        keys.clear();
+        groups.clear();
+    }
+
+public:
+    BatchExecutor(Storage& storage, OutputWriter& out, size_t windowSize)
+        : storage(storage), out(out), window(windowSize), keys(windowSize) {
+        groups.reserve(windowSize);
+        order.reserve(windowSize);
+    }
+
+    ~BatchExecutor() {
+        flush();
     }
 
-    // Delete entry
-    void remove(const string& index, int value) {
-        auto it = indexMap.find(index);
-        if (it == indexMap.end()) {
-            return; // Index doesn't exist
+    // Queue a command; the window runs once it is full
+    void add(char type, string_view index, int value, const FindPage& page = FindPage()) {
+        Command& command = window[count];
+        command.type = type;
+        command.key = keys.intern(index);
+        command.value = value;
+        command.page = page;
+        command.nextInGroup = NONE;
+        command.done = false;
+
+        if (command.key == groups.size()) {
+            groups.push_back(Group{static_cast<uint32_t>(count), static_cast<uint32_t>(count)});
+        } else {
+            window[groups[command.key].last].nextInGroup = count;
+            groups[command.key].last = count;
         }
 
-        // Find value using binary search
-        auto& values = it->second.values;
-        auto found = lower_bound(values.begin(), values.end(), value);
+        if (++count == window.size()) run();
+    }
 
-        if (found == values.end() || *found != value) {
-            return; // Value doesn't exist
+    void flush() {
+        if (count > 0) run();
+    }
+};
+
+// Reads the command stream from stdin in large chunks and splits it into
+// whitespace-separated tokens without going through iostream extraction
+class InputReader {
+private:
+    static constexpr size_t BUFFER_BYTES = 1 << 16;
+
+    char buffer[BUFFER_BYTES];
+    size_t pos = 0;
+    size_t end = 0;
+    string pushedBack;             // Word returned by unreadWord, read next
+    bool hasPushedBack = false;
+
+    // Takes whatever input is available, so commands that have arrived run
+    // without waiting for the buffer to fill
+    bool refill() {
+        pos = 0;
+#ifdef FILESTORAGE_HAVE_POSIX_IO
+        ssize_t got;
+        do {
+            got = ::read(STDIN_FILENO, buffer, BUFFER_BYTES);
+        } while (got < 0 && errno == EINTR);
+        end = got > 0 ? got : 0;
+#else
+        end = fread(buffer, 1, BUFFER_BYTES, stdin);
+#endif
+        return end > 0;
+    }
+
+    // Skip whitespace; returns false at end of input
+    bool skipSpace() {
+        while (true) {
+            while (pos < end && static_cast<unsigned char>(buffer[pos]) <= ' ') pos++;
+            if (pos < end) return true;
+            if (!refill()) return false;
         }
+    }
 
-        // Mark as deleted in file (this scans the file)
-        markDeleted(index, value);
+public:
+    // Read the next token into word, reusing its storage
+    bool readWord(string& word) {
+        FILESTORAGE_TIME(Timer::Parse);
+        if (hasPushedBack) {
+            word = pushedBack;
+            hasPushedBack = false;
+            return true;
+        }
+        word.clear();
+        if (!skipSpace()) return false;
+        while (true) {
+            size_t start = pos;
+            while (pos < end && static_cast<unsigned char>(buffer[pos]) > ' ') pos++;
+            word.append(buffer + start, pos - start);
+            if (pos < end || !refill()) return true;
+        }
+    }
 
-        // Remove from memory
-        values.erase(found);
-        if (values.empty()) {
-            indexMap.erase(it);
+    // Skip blanks up to the end of the line; true if a token follows on it
+    bool moreOnLine() {
+        if (hasPushedBack) return true;
+        while (true) {
+            while (pos < end && buffer[pos] != '\n' && static_cast<unsigned char>(buffer[pos]) <= ' ') pos++;
+            if (pos < end) return buffer[pos] != '\n';
+            if (!refill()) return false;
         }
     }
 
-    // Find all values for an index
-    void find(const string& index) {
-        auto it = indexMap.find(index);
-        if (it == indexMap.end() || it->second.values.empty()) {
-            cout << "null" << endl;
-            return;
+    // Hand back the word just read, for the next read to return
+    void unreadWord(const string& word) {
+        pushedBack = word;
+        hasPushedBack = true;
+    }
+
+    bool readInt(int& value) {
+        FILESTORAGE_TIME(Timer::Parse);
+        if (hasPushedBack) {
+            value = atoi(pushedBack.c_str());
+            hasPushedBack = false;
+            return true;
         }
+        if (!skipSpace()) return false;
+        bool negative = buffer[pos] == '-';
+        if (negative) pos++;
+
+        long long result = 0;
+        while (true) {
+            while (pos < end && buffer[pos] >= '0' && buffer[pos] <= '9') {
+                result = result * 10 + (buffer[pos++] - '0');
+            }
+            if (pos < end || !refill()) break;
+        }
+        value = static_cast<int>(negative ? -result : result);
+        return true;
+    }
+};
 
-        // Values are already sorted, just output them
-        const auto& values = it->second.values;
-        for (size_t i = 0; i < values.size(); i++) {
-            if (i > 0) cout << " ";
-            cout << values[i];
+// Reads the "limit N" and "after V" that may follow the index of a find
+// on its line. The first other word is handed back to input as the next
+// command. Nothing past the end of the line is read, so a find never waits
+// for the command after it.
+FindPage readFindPage(InputReader& input, string& word) {
+    FindPage page;
+    int value;
+    while (input.moreOnLine() && input.readWord(word)) {
+        if (word == "limit") {
+            input.readInt(value);
+            page.limit = max(value, 0);
+        } else if (word == "after") {
+            input.readInt(value);
+            page.after = value;
+        } else {
+            input.unreadWord(word);
+            break;
         }
-        cout << endl;
     }
+    return page;
+}
+
+// Options for the command loop itself
+struct CommandOptions {
+    size_t batchWindow = 0;  // Commands per batch window, 0 = run one by one
+    string loadFile;         // Bulk-loaded before any command runs
 };
 
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+// Parses --name=value flags into options; returns false on an unknown flag
+// or a bad value
+bool parseOptions(int argc, char* argv[], StorageOptions& options, CommandOptions& commandOptions) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        bool ok = true;
+        if (name == "--load") {
+            commandOptions.loadFile = value;
+        } else if (name == "--batch") {
+            ok = parseNumber(value, commandOptions.batchWindow);
+        } else {
+            ok = parseStorageOption(name, value, options);
+        }
+        if (!ok) {
+            cerr << "unknown option or bad value: " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-    FileStorage storage;
+// Bulk-loads path, telling on stderr what could not be read; false if the
+// file could not be opened
+template <typename Storage>
+bool loadFile(Storage& storage, const string& path) {
+    LoadResult result = storage.load(path);
+    if (!result.opened) {
+        cerr << path << ": cannot open for loading" << endl;
+        return false;
+    }
+    if (result.malformed > 0) {
+        cerr << path << ": skipped " << result.malformed << " malformed lines, the first at line "
+             << result.firstMalformed << endl;
+    }
+    return true;
+}
 
-    int n;
-    cin >> n;
+// Writes the instrumentation counters as of now
+void writeStats(OutputWriter& out) {
+    string report = statsReport();
+    out.write(report.data(), report.size());
+}
 
-    for (int i = 0; i < n; i++) {
-        string command;
-        cin >> command;
+// Runs the command stream against one storage engine
+template <typename Engine>
+int runCommands(const StorageOptions& options, const CommandOptions& commandOptions) {
+    ShardedStorage<Engine> storage(options);
+    if (!commandOptions.loadFile.empty() && !loadFile(storage, commandOptions.loadFile)) {
+        return 1;
+    }
+    InputReader input;
+    OutputWriter output;
+
+    int n = 0;
+    input.readInt(n);
+
+    // Token buffers are reused across commands
+    string command, index, last;
+    int value;
+
+    if (commandOptions.batchWindow > 0) {
+        BatchExecutor<ShardedStorage<Engine>> batch(storage, output, commandOptions.batchWindow);
+        for (int i = 0; i < n && input.readWord(command); i++) {
+            // Scans see every key, so the queued window runs first
+            if (command[0] == 's') {
+                batch.flush();
+                writeStats(output);
+                continue;
+            }
+            if (command[0] == 'r' || command[0] == 'p' || command[0] == 'l') {
+                batch.flush();
+                input.readWord(index);
+                if (command[0] == 'r') {
+                    input.readWord(last);
+                    storage.range(index, last, output);
+                } else if (command[0] == 'p') {
+                    storage.prefix(index, output);
+                } else {
+                    loadFile(storage, index);
+                }
+                continue;
+            }
+            if (strchr("idfce", command[0]) == nullptr) continue;
+            input.readWord(index);
+            value = 0;
+            if (command[0] == 'f') {
+                batch.add('f', index, value, readFindPage(input, last));
+                continue;
+            }
+            if (command[0] != 'c') input.readInt(value);
+            batch.add(command[0], index, value);
+        }
+        return 0;
+    }
 
-        if (command == "insert") {
-            string index;
-            int value;
-            cin >> index >> value;
+    for (int i = 0; i < n && input.readWord(command); i++) {
+        // Commands are told apart by their first byte
+        switch (command[0]) {
+        case 'i':  // insert
+            input.readWord(index);
+            input.readInt(value);
             storage.insert(index, value);
-        } else if (command == "delete") {
-            string index;
-            int value;
-            cin >> index >> value;
+            break;
+        case 'd':  // delete
+            input.readWord(index);
+            input.readInt(value);
             storage.remove(index, value);
-        } else if (command == "find") {
-            string index;
-            cin >> index;
-            storage.find(index);
+            break;
+        case 'f': {  // find index [limit N] [after V]
+            input.readWord(index);
+            FindPage page = readFindPage(input, last);
+            if (page.partial()) storage.findPage(index, page.after, page.limit, output);
+            else storage.find(index, output);
+            break;
+        }
+        case 'c':  // count index
+            input.readWord(index);
+            storage.count(index, output);
+            break;
+        case 'e':  // exists index value
+            input.readWord(index);
+            input.readInt(value);
+            storage.exists(index, value, output);
+            break;
+        case 'r':  // range lo hi
+            input.readWord(index);
+            input.readWord(last);
+            storage.range(index, last, output);
+            break;
+        case 'p':  // prefix
+            input.readWord(index);
+            storage.prefix(index, output);
+            break;
+        case 'l':  // load path
+            input.readWord(index);
+            loadFile(storage, index);
+            break;
+        case 's':  // stats
+            writeStats(output);
+            break;
         }
     }
 
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    StorageOptions options;
+    CommandOptions commandOptions;
+    if (!parseOptions(argc, argv, options, commandOptions)) {
+        return 1;
+    }
+
+    int status = options.engine == StorageEngine::Lsm ? runCommands<LsmStorage>(options, commandOptions)
+                                                      : runCommands<FileStorage>(options, commandOptions);
+#ifdef FILESTORAGE_STATS
+    // The storage is closed by now, so the final flushes are included
+    cerr << statsReport();
+#endif
+    return status;
+}
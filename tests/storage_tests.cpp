@@ -0,0 +1,191 @@
+// Reopen and crash recovery tests for both engines. Each case runs in a
+// fresh directory named after it under the working directory:
+//   storage_tests <case>
+#include "file_storage.h"
+
+#include <map>
+#include <set>
+
+using namespace std;
+using namespace filestorage;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << endl; \
+            exit(1);                                                                      \
+        }                                                                                 \
+    } while (0)
+
+using Expected = map<string, set<int>>;
+
+string indexName(int i) {
+    return "key" + to_string(i % 37);
+}
+
+// Every index of expected holds exactly its values, and no other index
+// of the ones written has any
+template <typename Storage>
+void checkContents(Storage& storage, const Expected& expected) {
+    for (int i = 0; i < 37; i++) {
+        string index = indexName(i);
+        vector<int> values;
+        storage.forEachValue(index, [&](int value) {
+            values.push_back(value);
+        });
+        auto it = expected.find(index);
+        vector<int> want;
+        if (it != expected.end()) want.assign(it->second.begin(), it->second.end());
+        CHECK(values == want);
+        CHECK(storage.countValues(index) == want.size());
+    }
+}
+
+template <typename Storage>
+void insertRange(Storage& storage, Expected& expected, int from, int to) {
+    for (int i = from; i < to; i++) {
+        storage.insert(indexName(i), i);
+        expected[indexName(i)].insert(i);
+    }
+}
+
+// A store that is never destroyed, as if the process had died, so nothing
+// beyond what each operation already wrote reaches the files
+template <typename Storage>
+Storage& abandon(const StorageOptions& options) {
+    return *new Storage(options);
+}
+
+template <typename Storage>
+void testReopen(StorageOptions options) {
+    Expected expected;
+    {
+        Storage storage(options);
+        insertRange(storage, expected, 0, 500);
+        for (int i = 0; i < 500; i += 7) {
+            storage.remove(indexName(i), i);
+            expected[indexName(i)].erase(i);
+        }
+        checkContents(storage, expected);
+    }
+    {
+        Storage storage(options);
+        checkContents(storage, expected);
+        insertRange(storage, expected, 500, 600);
+    }
+
+    // Every write below is on disk when it returns, but the store is never
+    // closed, so the reopen has to recover
+    options.durability = Durability::PerOp;
+    insertRange(abandon<Storage>(options), expected, 600, 700);
+    Storage storage(options);
+    checkContents(storage, expected);
+}
+
+// A clean close followed by a lost index: everything comes back from the log
+// and, when there is one, the checkpoint
+void testRebuild(StorageOptions options) {
+    Expected expected;
+    {
+        FileStorage storage(options);
+        insertRange(storage, expected, 0, 2000);
+    }
+    ::remove((DEFAULT_STORE + ".idx").c_str());
+    FileStorage storage(options);
+    checkContents(storage, expected);
+}
+
+// Cuts the last record of a log in half and checks that a reopen keeps every
+// record before it, drops the torn one and lets writing go on
+template <typename Storage>
+void testTornTail(StorageOptions options, const string& log) {
+    options.durability = Durability::PerOp;
+    Expected expected;
+    insertRange(abandon<Storage>(options), expected, 0, 300);
+    uint64_t records = 300;
+    CHECK(std::filesystem::file_size(log) == DATA_HEADER_BYTES + records * sizeof(DataRecord));
+
+    std::filesystem::resize_file(log, DATA_HEADER_BYTES + (records - 1) * sizeof(DataRecord) + sizeof(DataRecord) / 2);
+    expected[indexName(299)].erase(299);
+    {
+        Storage storage(options);
+        checkContents(storage, expected);
+        CHECK(std::filesystem::file_size(log) == DATA_HEADER_BYTES + (records - 1) * sizeof(DataRecord));
+        insertRange(storage, expected, 300, 350);
+    }
+    Storage storage(options);
+    checkContents(storage, expected);
+}
+
+// Damages a record in the middle of the data file. Replay stops at the first
+// record that fails its check, so it and everything after it are gone.
+void testCorruptRecord(StorageOptions options) {
+    options.durability = Durability::PerOp;
+    options.checkpointBytes = 0;
+    Expected expected;
+    insertRange(abandon<FileStorage>(options), expected, 0, 100);
+
+    string log = DEFAULT_STORE + ".db";
+    {
+        fstream file(log, ios::in | ios::out | ios::binary);
+        file.seekp(DATA_HEADER_BYTES + 60 * sizeof(DataRecord) + offsetof(DataRecord, key) + 1);
+        file.put('~');
+        CHECK(bool(file));
+    }
+    // The on-disk index would still be trusted; make the open replay
+    ::remove((DEFAULT_STORE + ".idx").c_str());
+    for (int i = 60; i < 100; i++) expected[indexName(i)].erase(i);
+
+    FileStorage storage(options);
+    checkContents(storage, expected);
+    CHECK(std::filesystem::file_size(log) == DATA_HEADER_BYTES + 60 * sizeof(DataRecord));
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        cerr << "usage: storage_tests <case>" << endl;
+        return 2;
+    }
+    string name = argv[1];
+    std::filesystem::remove_all(name);
+    std::filesystem::create_directories(name);
+    std::filesystem::current_path(name);
+
+    StorageOptions options;
+    options.cacheBytes = 64 << 10;
+    StorageOptions lsm = options;
+    lsm.engine = StorageEngine::Lsm;
+    lsm.memtableKeys = 64;
+    StorageOptions checkpointed = options;
+    checkpointed.checkpointBytes = 128 * sizeof(DataRecord);
+
+    if (name == "reopen") {
+        testReopen<FileStorage>(options);
+    } else if (name == "reopen_checkpoint") {
+        testReopen<FileStorage>(checkpointed);
+    } else if (name == "reopen_lsm") {
+        testReopen<LsmStorage>(lsm);
+    } else if (name == "rebuild") {
+        testRebuild(options);
+    } else if (name == "rebuild_parallel") {
+        StorageOptions parallel = options;
+        parallel.recoveryThreads = 4;
+        testRebuild(parallel);
+    } else if (name == "rebuild_checkpoint") {
+        testRebuild(checkpointed);
+    } else if (name == "torn_log") {
+        testTornTail<FileStorage>(options, DEFAULT_STORE + ".db");
+    } else if (name == "torn_log_checkpoint") {
+        testTornTail<FileStorage>(checkpointed, DEFAULT_STORE + ".db");
+    } else if (name == "torn_wal") {
+        // Keep the whole test in the memtable, so the log is all there is
+        lsm.memtableKeys = 1 << 20;
+        testTornTail<LsmStorage>(lsm, DEFAULT_STORE + ".wal");
+    } else if (name == "corrupt_record") {
+        testCorruptRecord(options);
+    } else {
+        cerr << "unknown case: " << name << endl;
+        return 2;
+    }
+    return 0;
+}